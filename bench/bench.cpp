@@ -0,0 +1,408 @@
+// Microbenchmarks for the C library.
+//
+// Each benchmark runs a single operation over and over on a label set
+// of a given size, in one or more threads at once (each with its own
+// set), timing batches of operations. Results are printed as JSON
+// (the default) or CSV.
+//
+// The library is linked in statically with `malloc` and friends wrapped
+// (see the `bench` target in the Makefile), so that allocations made
+// by each operation can be counted.
+//
+// Usage: bench [--format=json|csv] [--threads=1,4] [--labels=1,4,16,64]
+//              [--sizes=8:8,16:64,64:256] [--filter=SUBSTRING]
+//              [--samples=N] [--batch=N]
+
+#include <algorithm>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+#include "customlabels.h"
+#include "customlabels_inline.h"
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+static thread_local size_t allocs;
+
+void *__wrap_malloc(size_t size) {
+        ++allocs;
+        return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+        ++allocs;
+        return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+        ++allocs;
+        return __real_realloc(p, size);
+}
+}
+
+struct params {
+        size_t n_labels;
+        size_t key_len;
+        size_t value_len;
+};
+
+// The state each thread runs a benchmark against.
+struct ctx {
+        struct params p;
+        custom_labels_labelset_t *ls;
+        // `p.n_labels` keys that are in `ls`, then one that isn't.
+        std::vector<std::vector<unsigned char>> keys;
+        // Two values to alternate between.
+        std::vector<unsigned char> values[2];
+};
+
+static custom_labels_string_t str(const std::vector<unsigned char> &v) {
+        return (custom_labels_string_t) { v.size(), v.data() };
+}
+
+static void check(int error, const char *what) {
+        if (error) {
+                fprintf(stderr, "%s: %s\n", what, strerror(error));
+                exit(1);
+        }
+}
+
+static void ctx_init(struct ctx *c, struct params p) {
+        c->p = p;
+        for (size_t i = 0; i <= p.n_labels; ++i) {
+                std::vector<unsigned char> key(p.key_len, 'k');
+                // Distinct keys, differing in their last bytes like real ones tend to.
+                char digits[32];
+                int n = snprintf(digits, sizeof(digits), "%zu", i);
+                for (int j = 0; j < n && (size_t)j < p.key_len; ++j)
+                        key[p.key_len - 1 - j] = digits[n - 1 - j];
+                c->keys.push_back(key);
+        }
+        c->values[0].assign(p.value_len, 'a');
+        c->values[1].assign(p.value_len, 'b');
+        c->ls = custom_labels_new(p.n_labels);
+        if (!c->ls)
+                check(errno, "custom_labels_new");
+        for (size_t i = 0; i < p.n_labels; ++i)
+                check(custom_labels_set(c->ls, str(c->keys[i]), str(c->values[0]), NULL), "custom_labels_set");
+}
+
+static void ctx_destroy(struct ctx *c) {
+        if (custom_labels_current() == c->ls)
+                custom_labels_replace(NULL);
+        custom_labels_free(c->ls);
+}
+
+static const std::vector<unsigned char> &key_at(struct ctx *c, size_t i) {
+        return c->keys[i % c->p.n_labels];
+}
+
+static void *noop(void *data) {
+        return data;
+}
+
+static void op_set(struct ctx *c, size_t i) {
+        check(custom_labels_set(c->ls, str(key_at(c, i)), str(c->values[i & 1]), NULL), "custom_labels_set");
+}
+
+static void op_careful_set(struct ctx *c, size_t i) {
+        check(custom_labels_careful_set(c->ls, str(key_at(c, i)), str(c->values[i & 1]), NULL), "custom_labels_careful_set");
+}
+
+static void op_get(struct ctx *c, size_t i) {
+        if (!custom_labels_get(c->ls, str(key_at(c, i))))
+                check(ENOENT, "custom_labels_get");
+}
+
+static void op_get_miss(struct ctx *c, size_t) {
+        if (custom_labels_get(c->ls, str(c->keys[c->p.n_labels])))
+                check(EEXIST, "custom_labels_get");
+}
+
+static void op_delete_set(struct ctx *c, size_t i) {
+        custom_labels_delete(c->ls, str(key_at(c, i)));
+        op_set(c, i);
+}
+
+static void op_careful_delete_set(struct ctx *c, size_t i) {
+        custom_labels_careful_delete(c->ls, str(key_at(c, i)));
+        op_careful_set(c, i);
+}
+
+// Sets (or deletes and then sets) a middleware-sized group of labels
+// starting at `i`, in one call.
+#define MANY 8
+
+static void op_set_many(struct ctx *c, size_t i) {
+        custom_labels_label_t lbls[MANY];
+        for (size_t j = 0; j < MANY; ++j)
+                lbls[j] = (custom_labels_label_t) { str(key_at(c, i + j)), str(c->values[i & 1]) };
+        check(custom_labels_set_many(c->ls, lbls, MANY), "custom_labels_set_many");
+}
+
+static void op_delete_set_many(struct ctx *c, size_t i) {
+        custom_labels_string_t keys[MANY];
+        for (size_t j = 0; j < MANY; ++j)
+                keys[j] = str(key_at(c, i + j));
+        custom_labels_delete_many(c->ls, keys, MANY);
+        op_set_many(c, i);
+}
+
+static void op_run_with(struct ctx *c, size_t i) {
+        custom_labels_label_t lbl = { str(key_at(c, i)), str(c->values[1]) };
+        check(custom_labels_run_with(c->ls, &lbl, 1, noop, NULL, NULL), "custom_labels_run_with");
+}
+
+static void op_run_with_replace(struct ctx *c, size_t i) {
+        custom_labels_label_t lbl = { str(key_at(c, i)), str(c->values[1]) };
+        check(custom_labels_run_with_replace(&lbl, 1, noop, NULL, NULL), "custom_labels_run_with_replace");
+}
+
+static void op_clone(struct ctx *c, size_t) {
+        custom_labels_labelset_t *clone = custom_labels_clone_with_capacity(c->ls, c->p.n_labels + 1);
+        if (!clone)
+                check(errno, "custom_labels_clone_with_capacity");
+        custom_labels_free(clone);
+}
+
+static void op_replace(struct ctx *c, size_t i) {
+        custom_labels_replace(i & 1 ? NULL : c->ls);
+}
+
+static void op_replace_inline(struct ctx *c, size_t i) {
+        custom_labels_inline_replace(i & 1 ? NULL : c->ls);
+}
+
+static void op_debug_string(struct ctx *c, size_t) {
+        custom_labels_string_t s;
+        check(custom_labels_debug_string(c->ls, &s), "custom_labels_debug_string");
+        free((void *)s.buf);
+}
+
+// Installs the set as the current one, so that the non-careful
+// functions are exercised on it as well.
+static void setup_current(struct ctx *c) {
+        custom_labels_replace(c->ls);
+}
+
+struct benchmark {
+        const char *name;
+        void (*op)(struct ctx *, size_t);
+        void (*setup)(struct ctx *);
+};
+
+static const struct benchmark benchmarks[] = {
+        { "set", op_set, NULL },
+        { "set_current", op_set, setup_current },
+        { "careful_set", op_careful_set, NULL },
+        { "get", op_get, NULL },
+        { "get_miss", op_get_miss, NULL },
+        { "delete_set", op_delete_set, NULL },
+        { "delete_set_current", op_delete_set, setup_current },
+        { "careful_delete_set", op_careful_delete_set, NULL },
+        { "set_many", op_set_many, NULL },
+        { "set_many_current", op_set_many, setup_current },
+        { "delete_set_many", op_delete_set_many, NULL },
+        { "delete_set_many_current", op_delete_set_many, setup_current },
+        { "run_with", op_run_with, NULL },
+        { "run_with_replace", op_run_with_replace, setup_current },
+        { "clone_with_capacity", op_clone, NULL },
+        { "replace", op_replace, NULL },
+        { "replace_inline", op_replace_inline, NULL },
+        { "debug_string", op_debug_string, NULL },
+};
+
+struct options {
+        const char *format;
+        const char *filter;
+        std::vector<size_t> threads;
+        std::vector<size_t> labels;
+        std::vector<std::pair<size_t, size_t>> sizes;
+        size_t samples;
+        size_t batch;
+};
+
+// What one thread measured.
+struct thread_result {
+        // Nanoseconds per operation for each batch.
+        std::vector<double> samples;
+        size_t allocs;
+        // When the thread started and finished measuring.
+        double start, end;
+};
+
+static double now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run_thread(const struct benchmark *b, struct params p, const struct options *o,
+                       pthread_barrier_t *barrier, struct thread_result *out) {
+        struct ctx c;
+        ctx_init(&c, p);
+        if (b->setup)
+                b->setup(&c);
+        size_t i = 0;
+        // Warm up caches and any pools before measuring.
+        for (size_t j = 0; j < o->batch * 16; ++j)
+                b->op(&c, i++);
+        pthread_barrier_wait(barrier);
+        size_t allocs_before = allocs;
+        out->samples.reserve(o->samples);
+        out->start = now_ns();
+        for (size_t s = 0; s < o->samples; ++s) {
+                double start = now_ns();
+                for (size_t j = 0; j < o->batch; ++j)
+                        b->op(&c, i++);
+                out->samples.push_back((now_ns() - start) / o->batch);
+        }
+        out->end = now_ns();
+        out->allocs = allocs - allocs_before;
+        ctx_destroy(&c);
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+        size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+        return sorted[i];
+}
+
+static void run(const struct benchmark *b, struct params p, size_t n_threads, const struct options *o, bool first) {
+        pthread_barrier_t barrier;
+        pthread_barrier_init(&barrier, NULL, n_threads + 1);
+        std::vector<struct thread_result> results(n_threads);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < n_threads; ++t)
+                threads.emplace_back(run_thread, b, p, o, &barrier, &results[t]);
+        pthread_barrier_wait(&barrier);
+        for (auto &t : threads)
+                t.join();
+        pthread_barrier_destroy(&barrier);
+
+        std::vector<double> samples;
+        size_t n_allocs = 0;
+        double start = results[0].start, end = results[0].end;
+        for (auto &r : results) {
+                start = std::min(start, r.start);
+                end = std::max(end, r.end);
+                samples.insert(samples.end(), r.samples.begin(), r.samples.end());
+                n_allocs += r.allocs;
+        }
+        std::sort(samples.begin(), samples.end());
+        double total = 0;
+        for (double s : samples)
+                total += s;
+        size_t ops = o->samples * o->batch * n_threads;
+        double mean = total / samples.size();
+        double allocs_per_op = (double)n_allocs / ops;
+        double mops = ops / (end - start) * 1e3;
+
+        if (!strcmp(o->format, "csv")) {
+                if (first)
+                        printf("name,threads,labels,key_len,value_len,ops,ns_per_op,p50,p90,p99,max,allocs_per_op,mops_per_s\n");
+                printf("%s,%zu,%zu,%zu,%zu,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.3f,%.3f\n",
+                       b->name, n_threads, p.n_labels, p.key_len, p.value_len, ops, mean,
+                       percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99),
+                       samples.back(), allocs_per_op, mops);
+        } else {
+                printf("%s\n  {\"name\": \"%s\", \"threads\": %zu, \"labels\": %zu, \"key_len\": %zu, \"value_len\": %zu, "
+                       "\"ops\": %zu, \"ns_per_op\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f, "
+                       "\"allocs_per_op\": %.3f, \"mops_per_s\": %.3f}",
+                       first ? "[" : ",", b->name, n_threads, p.n_labels, p.key_len, p.value_len, ops, mean,
+                       percentile(samples, 0.5), percentile(samples, 0.9), percentile(samples, 0.99),
+                       samples.back(), allocs_per_op, mops);
+        }
+        fflush(stdout);
+}
+
+static std::vector<size_t> parse_list(const char *s) {
+        std::vector<size_t> out;
+        for (char *end; *s; s = end + (*end == ',')) {
+                out.push_back(strtoul(s, &end, 10));
+                if (end == s) {
+                        fprintf(stderr, "bad list: %s\n", s);
+                        exit(2);
+                }
+        }
+        return out;
+}
+
+static void usage() {
+        fprintf(stderr, "usage: bench [--format=json|csv] [--threads=1,4] [--labels=1,4,16,64]\n"
+                        "             [--sizes=8:8,16:64,64:256] [--filter=SUBSTRING]\n"
+                        "             [--samples=N] [--batch=N]\n");
+        exit(2);
+}
+
+int main(int argc, char **argv) {
+        struct options o;
+        o.format = "json";
+        o.filter = "";
+        o.threads = { 1, 4 };
+        o.labels = { 1, 4, 16, 64 };
+        o.sizes = { { 8, 8 }, { 16, 64 }, { 64, 256 } };
+        o.samples = 1000;
+        o.batch = 64;
+        for (int i = 1; i < argc; ++i) {
+                const char *arg = argv[i];
+                const char *eq = strchr(arg, '=');
+                if (strncmp(arg, "--", 2) || !eq)
+                        usage();
+                std::string name(arg + 2, eq);
+                const char *value = eq + 1;
+                if (name == "format" && (!strcmp(value, "json") || !strcmp(value, "csv")))
+                        o.format = value;
+                else if (name == "filter")
+                        o.filter = value;
+                else if (name == "threads")
+                        o.threads = parse_list(value);
+                else if (name == "labels")
+                        o.labels = parse_list(value);
+                else if (name == "samples")
+                        o.samples = strtoul(value, NULL, 10);
+                else if (name == "batch")
+                        o.batch = strtoul(value, NULL, 10);
+                else if (name == "sizes") {
+                        o.sizes.clear();
+                        for (char *end; *value; value = end + (*end == ',')) {
+                                size_t k = strtoul(value, &end, 10);
+                                if (*end != ':')
+                                        usage();
+                                size_t v = strtoul(end + 1, &end, 10);
+                                o.sizes.push_back({ k, v });
+                        }
+                } else
+                        usage();
+        }
+        if (!o.samples || !o.batch)
+                usage();
+
+        bool first = true;
+        for (const struct benchmark &b : benchmarks) {
+                if (!strstr(b.name, o.filter))
+                        continue;
+                for (size_t n_threads : o.threads)
+                        for (size_t n_labels : o.labels)
+                                for (auto &size : o.sizes) {
+                                        // Every benchmark needs at least one label
+                                        // to operate on, and keys must be distinct.
+                                        if (!n_labels || size.first < 4)
+                                                continue;
+                                        run(&b, (struct params) { n_labels, size.first, size.second }, n_threads, &o, first);
+                                        first = false;
+                                }
+        }
+        if (!strcmp(o.format, "json"))
+                printf("%s\n", first ? "[]" : "\n]");
+        return 0;
+}
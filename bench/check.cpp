@@ -0,0 +1,832 @@
+// Randomized checks of the C library against a model.
+//
+// Each round applies random operations (see `ops`) to a label set, either
+// detached or installed as the current set so that both the plain and the
+// careful paths are covered, and to a `std::map` that models it, and
+// checks after every operation that the set holds exactly the labels the
+// model says it should, with the right types. The checks called from
+// `main` cover what the model doesn't; among them, `custom_labels_decode`
+// is fed mutated encodings and compared with a reference decoder. Build
+// it with sanitizers to catch memory errors, e.g.:
+//
+//   make -B check CXXFLAGS="-O1 -g -fsanitize=address,undefined"
+//
+// It exits with a non-zero status at the first mismatch, printing the
+// seed it was run with.
+//
+// Usage: check [--rounds=N] [--seed=N]
+
+#include <atomic>
+#include <errno.h>
+#include <map>
+#include <pthread.h>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "customlabels.h"
+
+// Enough keys for sets to grow past INDEX_MIN_LABELS in customlabels.cpp
+// and be looked up through their index.
+#define N_KEYS 40
+// Enough labels in a batch to take the sorted path (see
+// BATCH_SORT_MIN_LABELS in customlabels.cpp) as well as the pairwise one.
+#define MAX_BATCH 40
+#define MAX_VALUE_LEN 48
+
+static uint64_t seed;
+
+#define CHECK(cond)                                                                     \
+        do {                                                                            \
+                if (!(cond)) {                                                          \
+                        fprintf(stderr, "%s:%d: check failed: %s (seed %llu)\n",        \
+                                __FILE__, __LINE__, #cond, (unsigned long long)seed);   \
+                        exit(1);                                                        \
+                }                                                                       \
+        } while (0)
+
+static uint64_t xorshift(uint64_t *state) {
+        uint64_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return *state = x;
+}
+
+// Keys have different lengths, and some are prefixes of others.
+static std::string keys[N_KEYS];
+static custom_labels_key_t key_handles[N_KEYS];
+// Values that outlive every set, for borrowing.
+static std::string static_values[N_KEYS];
+
+static custom_labels_string_t str(const std::string &s) {
+        return (custom_labels_string_t) { s.size(), (const unsigned char *)s.data() };
+}
+
+static std::string to_string(custom_labels_string_t s) {
+        return std::string((const char *)s.buf, s.len);
+}
+
+struct entry {
+        unsigned type;
+        // For typed values, their 8 little-endian bytes.
+        std::string bytes;
+};
+
+typedef std::map<std::string, struct entry> model_t;
+
+static std::string le_bytes(uint64_t v) {
+        std::string out(8, '\0');
+        for (int i = 0; i < 8; ++i)
+                out[i] = (char)(v >> (8 * i));
+        return out;
+}
+
+static uint64_t from_le_bytes(const std::string &s) {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i)
+                v |= (uint64_t)(unsigned char)s[i] << (8 * i);
+        return v;
+}
+
+// The value as it appears in encodings: typed values are in decimal.
+static std::string text(const struct entry &e) {
+        if (e.type == CUSTOM_LABELS_VALUE_U64)
+                return std::to_string(from_le_bytes(e.bytes));
+        if (e.type == CUSTOM_LABELS_VALUE_I64)
+                return std::to_string((int64_t)from_le_bytes(e.bytes));
+        return e.bytes;
+}
+
+static unsigned random_key(uint64_t *rng) {
+        return xorshift(rng) % N_KEYS;
+}
+
+static std::string random_value(uint64_t *rng) {
+        size_t len = xorshift(rng) % MAX_VALUE_LEN;
+        std::string v(len, '\0');
+        for (size_t i = 0; i < len; ++i)
+                v[i] = (char)xorshift(rng);
+        return v;
+}
+
+static void check_set(custom_labels_labelset_t *ls, const model_t &m) {
+        CHECK(custom_labels_count(ls) == m.size());
+        for (auto &kv : m) {
+                const custom_labels_label_t *lbl = custom_labels_get(ls, str(kv.first));
+                CHECK(lbl);
+                CHECK(to_string(lbl->key) == kv.first);
+                CHECK(to_string(lbl->value) == kv.second.bytes);
+                CHECK(custom_labels_value_type(ls, lbl) == kv.second.type);
+        }
+}
+
+// Decodes an encoding the slow way, or returns false if it's malformed.
+static bool reference_decode(const std::string &buf, model_t *out) {
+        if (buf.size() < 6 || (unsigned char)buf[0] != CUSTOM_LABELS_SNAPSHOT_VERSION)
+                return false;
+        uint64_t n = from_le_bytes(buf.substr(2, 4) + std::string(4, '\0'));
+        size_t pos = 6;
+        for (uint64_t i = 0; i < n; ++i) {
+                std::string strs[2];
+                for (int k = 0; k < 2; ++k) {
+                        if (buf.size() - pos < 4)
+                                return false;
+                        size_t len = from_le_bytes(buf.substr(pos, 4) + std::string(4, '\0'));
+                        pos += 4;
+                        if (buf.size() - pos < len)
+                                return false;
+                        strs[k] = buf.substr(pos, len);
+                        pos += len;
+                }
+                (*out)[strs[0]] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, strs[1] };
+        }
+        return pos == buf.size();
+}
+
+static std::string encode(const custom_labels_labelset_t *ls) {
+        size_t size = custom_labels_encode_into(ls, NULL, 0);
+        std::string buf(size, '\0');
+        CHECK(custom_labels_encode_into(ls, &buf[0], size) == size);
+        return buf;
+}
+
+// What a set decoded from an encoding of `m` holds: typed values become text.
+static model_t as_text(const model_t &m) {
+        model_t out;
+        for (auto &kv : m)
+                out[kv.first] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, text(kv.second) };
+        return out;
+}
+
+// Set on threads whose current set other threads read. Scopes borrow the
+// strings of their labels, which readers may still be reading after the
+// scopes are popped, so batches there take values that outlive them.
+static thread_local bool read_by_others;
+
+// A batch of labels with random keys, which often repeat.
+static void random_batch(uint64_t *rng, std::vector<std::string> *values, std::vector<custom_labels_label_t> *labels) {
+        size_t n = xorshift(rng) % (MAX_BATCH + 1);
+        values->resize(n);
+        labels->resize(n);
+        for (size_t i = 0; i < n; ++i) {
+                unsigned k = random_key(rng);
+                (*values)[i] = read_by_others ? static_values[k] : random_value(rng);
+                (*labels)[i].key = str(keys[k]);
+                (*labels)[i].value = str(read_by_others ? static_values[k] : (*values)[i]);
+        }
+}
+
+struct run_with_data {
+        // The set the callback should see, or NULL for the current set.
+        custom_labels_labelset_t *ls;
+        const model_t *expected;
+};
+
+static void *check_in_callback(void *data) {
+        struct run_with_data *d = (struct run_with_data *)data;
+        check_set(d->ls ? d->ls : custom_labels_current(), *d->expected);
+        return data;
+}
+
+// An operation on the set `*lsp` (which it may replace) and its model
+// `m`. `current` says whether the set is installed as the current set.
+typedef void (*op_fn)(custom_labels_labelset_t **lsp, model_t &m, bool current, uint64_t *rng);
+
+static void op_set(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        const std::string &key = keys[random_key(rng)];
+        std::string value = random_value(rng);
+        custom_labels_string_t old;
+        CHECK(!custom_labels_set(*lsp, str(key), str(value), &old));
+        auto it = m.find(key);
+        CHECK(!old.buf == (it == m.end()));
+        if (old.buf && it->second.type == CUSTOM_LABELS_VALUE_BYTES)
+                CHECK(to_string(old) == it->second.bytes);
+        free((void *)old.buf);
+        m[key] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, value };
+}
+
+static void op_delete(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        const std::string &key = keys[random_key(rng)];
+        custom_labels_delete(*lsp, str(key));
+        m.erase(key);
+}
+
+static void op_set_owned(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        const std::string &key = keys[random_key(rng)];
+        std::string value = random_value(rng);
+        // Hand over copies of both strings.
+        char *key_copy = (char *)malloc(key.size() + 1);
+        char *value_copy = (char *)malloc(value.size() + 1);
+        memcpy(key_copy, key.c_str(), key.size() + 1);
+        memcpy(value_copy, value.data(), value.size());
+        custom_labels_string_t kc = { key.size(), (const unsigned char *)key_copy };
+        custom_labels_string_t vc = { value.size(), (const unsigned char *)value_copy };
+        CHECK(!custom_labels_set_ex(*lsp, kc, vc, CUSTOM_LABELS_KEY_OWNED | CUSTOM_LABELS_VALUE_OWNED, NULL));
+        m[key] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, value };
+}
+
+static void op_set_borrowed(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        unsigned k = random_key(rng);
+        CHECK(!custom_labels_set_ex(*lsp, str(keys[k]), str(static_values[k]),
+                                    CUSTOM_LABELS_KEY_BORROWED | CUSTOM_LABELS_VALUE_BORROWED, NULL));
+        m[keys[k]] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, static_values[k] };
+        CHECK(custom_labels_get(*lsp, str(keys[k]))->value.buf == (const unsigned char *)static_values[k].data());
+}
+
+static void op_set_k(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        unsigned k = random_key(rng);
+        std::string value = random_value(rng);
+        CHECK(!custom_labels_set_k(*lsp, key_handles[k], str(value), NULL));
+        m[keys[k]] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, value };
+        const custom_labels_label_t *lbl = custom_labels_get_k(*lsp, key_handles[k]);
+        CHECK(lbl && to_string(lbl->value) == value);
+}
+
+static void op_delete_k(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        unsigned k = random_key(rng);
+        custom_labels_delete_k(*lsp, key_handles[k]);
+        m.erase(keys[k]);
+        CHECK(!custom_labels_get_k(*lsp, key_handles[k]));
+}
+
+// A new set with the labels of `m`, set in reverse order.
+static custom_labels_labelset_t *build(const model_t &m) {
+        custom_labels_labelset_t *ls = custom_labels_new(0);
+        CHECK(ls);
+        for (auto it = m.rbegin(); it != m.rend(); ++it)
+                CHECK(!custom_labels_set(ls, str(it->first), str(it->second.bytes), NULL));
+        return ls;
+}
+
+// Interns the set, and checks that sets with the same labels (typed
+// values being the same as their text) get the same ID and others don't.
+static void op_intern(custom_labels_labelset_t **lsp, model_t &m, bool current, uint64_t *rng) {
+        uint64_t id, other_id;
+        CHECK(!custom_labels_intern_set(*lsp, &id));
+        CHECK(id && custom_labels_set_id(*lsp) == id);
+        CHECK(id <= custom_labels_id_table.count);
+        const custom_labels_id_entry_t *entry = &custom_labels_id_table.chunks[(id - 1) / CUSTOM_LABELS_ID_CHUNK_SIZE]
+                                                                              [(id - 1) % CUSTOM_LABELS_ID_CHUNK_SIZE];
+        model_t text_m = as_text(m);
+        CHECK(entry->count == m.size());
+        for (size_t i = 0; i < entry->count; ++i) {
+                auto it = text_m.find(to_string(entry->labels[i].key));
+                CHECK(it != text_m.end() && it->second.bytes == to_string(entry->labels[i].value));
+        }
+
+        // A frozen set only has an ID if it was interned before it was frozen.
+        custom_labels_labelset_t *same = build(text_m);
+        bool before = xorshift(rng) % 2;
+        if (before)
+                CHECK(!custom_labels_intern_set(same, &other_id));
+        custom_labels_freeze(same);
+        if (!before)
+                CHECK(!custom_labels_intern_set(same, &other_id));
+        CHECK(other_id == id);
+        CHECK(custom_labels_set_id(same) == (before ? id : 0));
+        custom_labels_free(same);
+
+        // Clones keep the ID until they're changed.
+        custom_labels_labelset_t *other = custom_labels_clone(*lsp);
+        CHECK(other && custom_labels_set_id(other) == id);
+        const std::string &key = keys[random_key(rng)];
+        auto it = text_m.find(key);
+        std::string value = it == text_m.end() ? "" : it->second.bytes + "!";
+        CHECK(!custom_labels_set(other, str(key), str(value), NULL));
+        CHECK(custom_labels_set_id(other) == 0);
+        CHECK(!custom_labels_intern_set(other, &other_id));
+        CHECK(other_id != id);
+        custom_labels_free(other);
+        if (current)
+                CHECK(custom_labels_current_id == id);
+}
+
+// Sets a typed value, by key string or handle.
+static void op_typed(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        unsigned k = random_key(rng);
+        uint64_t r = xorshift(rng);
+        if (r & 1) {
+                CHECK(!custom_labels_set_u64(*lsp, str(keys[k]), r));
+                m[keys[k]] = (struct entry) { CUSTOM_LABELS_VALUE_U64, le_bytes(r) };
+                uint64_t got;
+                CHECK(!custom_labels_get_u64(*lsp, str(keys[k]), &got) && got == r);
+        } else {
+                int64_t v = -(int64_t)(r >> 1);
+                CHECK(!custom_labels_set_i64_k(*lsp, key_handles[k], v));
+                m[keys[k]] = (struct entry) { CUSTOM_LABELS_VALUE_I64, le_bytes(v) };
+                int64_t got;
+                CHECK(!custom_labels_get_i64(*lsp, str(keys[k]), &got) && got == v);
+                // The types don't mix.
+                CHECK(custom_labels_get_u64(*lsp, str(keys[k]), (uint64_t *)&got) == EINVAL);
+        }
+}
+
+// Sets a batch of labels, in which keys may repeat.
+static void op_set_many(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        std::vector<std::string> values;
+        std::vector<custom_labels_label_t> labels;
+        random_batch(rng, &values, &labels);
+        CHECK(!custom_labels_set_many(*lsp, labels.data(), labels.size()));
+        for (auto &l : labels)
+                m[to_string(l.key)] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, to_string(l.value) };
+}
+
+static void op_delete_many(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        std::vector<custom_labels_string_t> ks(xorshift(rng) % (MAX_BATCH + 1));
+        for (auto &s : ks) {
+                s = str(keys[random_key(rng)]);
+                m.erase(to_string(s));
+        }
+        custom_labels_delete_many(*lsp, ks.data(), ks.size());
+}
+
+// Replaces the set with a clone of it.
+static void op_clone(custom_labels_labelset_t **lsp, model_t &m, bool current, uint64_t *) {
+        custom_labels_labelset_t *clone = custom_labels_clone(*lsp);
+        CHECK(clone);
+        check_set(clone, m);
+        if (current)
+                CHECK(custom_labels_replace(clone) == *lsp);
+        custom_labels_free(*lsp);
+        *lsp = clone;
+}
+
+// Runs a callback with some labels changed, which are put back afterwards.
+static void op_run_with(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        std::vector<std::string> values;
+        std::vector<custom_labels_label_t> labels;
+        random_batch(rng, &values, &labels);
+        // Each key once, since the old values are put back in order.
+        unsigned k = random_key(rng);
+        labels.resize(labels.size() % 6);
+        for (size_t i = 0; i < labels.size(); ++i)
+                labels[i].key = str(keys[(k + i) % N_KEYS]);
+        model_t during = m;
+        for (auto &l : labels)
+                during[to_string(l.key)] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, to_string(l.value) };
+        // Keys that weren't set before are left with null values.
+        for (auto &l : labels)
+                if (!m.count(to_string(l.key)))
+                        m[to_string(l.key)] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, "" };
+        struct run_with_data d = { *lsp, &during };
+        void *out;
+        CHECK(!custom_labels_run_with(*lsp, labels.data(), labels.size(), check_in_callback, &d, &out));
+        CHECK(out == &d);
+}
+
+// Runs a callback under a derived current set, leaving this one alone.
+static void op_run_with_replace(custom_labels_labelset_t **lsp, model_t &m, bool current, uint64_t *rng) {
+        if (!current)
+                return;
+        std::vector<std::string> values;
+        std::vector<custom_labels_label_t> labels;
+        random_batch(rng, &values, &labels);
+        model_t during = m;
+        for (auto &l : labels)
+                during[to_string(l.key)] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, to_string(l.value) };
+        struct run_with_data d = { NULL, &during };
+        void *out;
+        CHECK(!custom_labels_run_with_replace(labels.data(), labels.size(), check_in_callback, &d, &out));
+        CHECK(out == &d);
+        CHECK(custom_labels_current() == *lsp);
+}
+
+// Pushes one or two scopes on top of the current set, checking each,
+// and pops them.
+static void op_scope(custom_labels_labelset_t **lsp, model_t &m, bool current, uint64_t *rng) {
+        if (!current)
+                return;
+        std::vector<std::string> values[2];
+        std::vector<custom_labels_label_t> labels[2];
+        custom_labels_scope_t scopes[2];
+        model_t during = m;
+        unsigned n = 1 + xorshift(rng) % 2;
+        for (unsigned i = 0; i < n; ++i) {
+                random_batch(rng, &values[i], &labels[i]);
+                for (auto &l : labels[i])
+                        during[to_string(l.key)] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, to_string(l.value) };
+                CHECK(!custom_labels_scope_push(labels[i].data(), labels[i].size(), &scopes[i]));
+                check_set(custom_labels_current(), during);
+        }
+        while (n--)
+                custom_labels_scope_pop(scopes[n]);
+        CHECK(custom_labels_current() == *lsp);
+}
+
+// Encodes the set and decodes it again.
+static void op_encode(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *) {
+        custom_labels_labelset_t *decoded;
+        std::string buf = encode(*lsp);
+        CHECK(!custom_labels_decode(buf.data(), buf.size(), 0, &decoded));
+        check_set(decoded, as_text(m));
+        custom_labels_free(decoded);
+}
+
+// Decodes the labels of another set into this one.
+static void op_decode_into(custom_labels_labelset_t **lsp, model_t &m, bool, uint64_t *rng) {
+        model_t other;
+        custom_labels_labelset_t *src = custom_labels_new(0);
+        for (unsigned i = 0, n = xorshift(rng) % 8; i < n; ++i) {
+                const std::string &key = keys[random_key(rng)];
+                std::string value = random_value(rng);
+                CHECK(!custom_labels_set(src, str(key), str(value), NULL));
+                other[key] = (struct entry) { CUSTOM_LABELS_VALUE_BYTES, value };
+        }
+        std::string buf = encode(src);
+        custom_labels_free(src);
+        CHECK(!custom_labels_decode_into(*lsp, buf.data(), buf.size(), 0));
+        for (auto &kv : other)
+                m[kv.first] = kv.second;
+}
+
+// The operations to choose from, some more often than others.
+static const op_fn ops[] = {
+        op_set, op_set, op_set,
+        op_delete, op_delete,
+        op_set_k,
+        op_delete_k,
+        op_set_owned,
+        op_set_borrowed,
+        op_typed, op_typed,
+        op_set_many,
+        op_delete_many,
+        op_clone,
+        op_intern,
+        op_run_with,
+        op_run_with_replace,
+        op_scope,
+        op_encode,
+        op_decode_into,
+};
+
+// Checks snapshots of the current set, which `m` models, into a buffer
+// of the right size and into one that is a byte short.
+static void check_snapshot(const model_t &m) {
+        std::string snap(custom_labels_encode_into(custom_labels_current(), NULL, 0), '\0');
+        CHECK(custom_labels_snapshot_current(&snap[0], snap.size()) == snap.size());
+        custom_labels_labelset_t *decoded;
+        CHECK(!custom_labels_decode(snap.data(), snap.size(), 0, &decoded));
+        check_set(decoded, as_text(m));
+        custom_labels_free(decoded);
+        if (snap.size() == 6)
+                return;
+        std::string cut(snap.size() - 1, '\0');
+        cut.resize(custom_labels_snapshot_current(&cut[0], cut.size()));
+        CHECK(cut.size() >= 6 && (cut[1] & CUSTOM_LABELS_SNAPSHOT_TRUNCATED));
+        // What fits is a prefix of the labels.
+        model_t prefix, text_m = as_text(m);
+        CHECK(reference_decode(cut, &prefix));
+        CHECK(prefix.size() < m.size());
+        for (auto &kv : prefix)
+                CHECK(text_m.count(kv.first) && text_m[kv.first].bytes == kv.second.bytes);
+}
+
+// Does one random operation on `*lsp` and `m`.
+static void step(custom_labels_labelset_t **lsp, model_t &m, bool current, uint64_t *rng) {
+        ops[xorshift(rng) % (sizeof(ops) / sizeof(ops[0]))](lsp, m, current, rng);
+        if (current) {
+                CHECK(custom_labels_current() == *lsp);
+                // The ID, if any, is published with the set.
+                CHECK(custom_labels_current_id == custom_labels_set_id(*lsp));
+                check_snapshot(m);
+        }
+        check_set(*lsp, m);
+}
+
+static void check_model(unsigned rounds) {
+        uint64_t rng = seed;
+        for (unsigned round = 0; round < rounds; ++round) {
+                bool current = round % 2;
+                model_t m;
+                custom_labels_labelset_t *ls = custom_labels_new(xorshift(&rng) % 8);
+                CHECK(ls);
+                if (current)
+                        custom_labels_replace(ls);
+                for (unsigned i = 0; i < 200; ++i)
+                        step(&ls, m, current, &rng);
+                if (current)
+                        CHECK(custom_labels_replace(NULL) == ls);
+                custom_labels_free(ls);
+        }
+}
+
+// Frozen sets can't be changed, only cloned, and may be installed on
+// several threads at once.
+static void check_frozen() {
+        custom_labels_labelset_t *ls = custom_labels_new(0);
+        CHECK(!custom_labels_set(ls, str(keys[0]), str("a"), NULL));
+        CHECK(!custom_labels_set_u64(ls, str(keys[1]), 7));
+        model_t m = { { keys[0], { CUSTOM_LABELS_VALUE_BYTES, "a" } },
+                      { keys[1], { CUSTOM_LABELS_VALUE_U64, le_bytes(7) } } };
+        custom_labels_freeze(ls);
+        custom_labels_freeze(ls);
+        CHECK(custom_labels_is_frozen(ls));
+        CHECK(custom_labels_set(ls, str(keys[2]), str("c"), NULL) == EPERM);
+        CHECK(custom_labels_set_k(ls, key_handles[0], str("c"), NULL) == EPERM);
+        CHECK(custom_labels_set_u64(ls, str(keys[0]), 1) == EPERM);
+        custom_labels_label_t lbl = { str(keys[3]), str("c") };
+        CHECK(custom_labels_set_many(ls, &lbl, 1) == EPERM);
+        custom_labels_delete(ls, str(keys[0]));
+        custom_labels_delete_k(ls, key_handles[0]);
+        custom_labels_string_t k = str(keys[1]);
+        custom_labels_delete_many(ls, &k, 1);
+        check_set(ls, m);
+
+        // Clones can be changed.
+        custom_labels_labelset_t *clone = custom_labels_clone(ls);
+        CHECK(!custom_labels_is_frozen(clone));
+        CHECK(!custom_labels_set(clone, str(keys[2]), str("c"), NULL));
+        custom_labels_free(clone);
+
+        // Installed on several threads at once, each holding a reference.
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+                custom_labels_labelset_t *ref = custom_labels_retain(ls);
+                CHECK(ref == ls);
+                threads.emplace_back([ref, &m] {
+                        custom_labels_replace(ref);
+                        check_set(custom_labels_current(), m);
+                        custom_labels_replace(NULL);
+                        custom_labels_free(ref);
+                });
+        }
+        for (auto &t : threads)
+                t.join();
+        check_set(ls, m);
+        custom_labels_free(ls);
+}
+
+// Takes sets from the pool and gives them back, with the pool's limits
+// low enough that some are freed instead.
+static void check_pool(unsigned rounds) {
+        uint64_t rng = seed ^ 0x5bd1e995;
+        custom_labels_pool_configure(8, 1 << 20);
+        custom_labels_pool_stats_t before, after;
+        custom_labels_pool_stats(&before);
+        std::vector<custom_labels_labelset_t *> live;
+        for (unsigned i = 0; i < rounds * 20; ++i) {
+                if (live.empty() || xorshift(&rng) % 2) {
+                        // Sets from the pool start out empty.
+                        custom_labels_labelset_t *ls = custom_labels_new(xorshift(&rng) % 32);
+                        CHECK(ls);
+                        check_set(ls, model_t());
+                        model_t m;
+                        for (unsigned j = 0, n = xorshift(&rng) % 20; j < n; ++j)
+                                step(&ls, m, false, &rng);
+                        live.push_back(ls);
+                } else {
+                        size_t j = xorshift(&rng) % live.size();
+                        custom_labels_free(live[j]);
+                        live[j] = live.back();
+                        live.pop_back();
+                }
+        }
+        for (auto ls : live)
+                custom_labels_free(ls);
+        custom_labels_pool_stats(&after);
+        CHECK(after.hits > before.hits);
+        CHECK(after.sets <= 8 && after.bytes <= (1 << 20));
+        custom_labels_pool_configure(0, 0);
+}
+
+static std::atomic<custom_labels_labelset_t *volatile *> reclaim_target;
+static std::atomic<bool> reclaim_done;
+
+// The fields of a label set that readers rely on.
+struct abi_labelset {
+        custom_labels_label_t *storage;
+        size_t count;
+        size_t capacity;
+        uint64_t generation;
+};
+
+// Reads the labels of the current set of another thread, announcing the
+// read. The thread isn't stopped, so the set is read like a seqlock: the
+// labels are copied out between two reads of the generation, and their
+// strings are only looked at if it was even and didn't change.
+static void reclaim_reader() {
+        unsigned long sum = 0;
+        custom_labels_label_t labels[2 * N_KEYS];
+        while (!reclaim_done) {
+                uint64_t token = custom_labels_read_begin();
+                custom_labels_labelset_t *volatile *target = reclaim_target;
+                struct abi_labelset *ls = target ? (struct abi_labelset *)*target : NULL;
+                uint64_t generation = ls ? __atomic_load_n(&ls->generation, __ATOMIC_ACQUIRE) : 1;
+                size_t count = 0;
+                if (!(generation & 1)) {
+                        count = __atomic_load_n(&ls->count, __ATOMIC_RELAXED);
+                        custom_labels_label_t *storage = __atomic_load_n(&ls->storage, __ATOMIC_RELAXED);
+                        if (count > 2 * N_KEYS)
+                                count = 0;
+                        for (size_t i = 0; i < count; ++i)
+                                labels[i] = storage[i];
+                        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                        if (__atomic_load_n(&ls->generation, __ATOMIC_RELAXED) != generation)
+                                count = 0;
+                }
+                for (size_t i = 0; i < count; ++i) {
+                        if (!labels[i].key.buf)
+                                continue;
+                        for (size_t j = 0; j < labels[i].key.len; ++j)
+                                sum += ((volatile const unsigned char *)labels[i].key.buf)[j];
+                        for (size_t j = 0; labels[i].value.buf && j < labels[i].value.len; ++j)
+                                sum += ((volatile const unsigned char *)labels[i].value.buf)[j];
+                }
+                custom_labels_read_end(token);
+        }
+        (void)sum;
+}
+
+// Runs the model on a thread whose current set two others keep reading,
+// with and without a quarantine.
+static void check_reclaim(unsigned rounds) {
+        for (size_t max_bytes : { (size_t)0, (size_t)1 << 16 }) {
+                custom_labels_reclaim_configure(max_bytes);
+                reclaim_done = false;
+                std::thread r1(reclaim_reader), r2(reclaim_reader);
+                std::thread mutator([rounds] {
+                        uint64_t rng = seed ^ 0xdeadbeef;
+                        read_by_others = true;
+                        reclaim_target = &custom_labels_current_set;
+                        for (unsigned round = 0; round < rounds; ++round) {
+                                model_t m;
+                                custom_labels_labelset_t *ls = custom_labels_new(0);
+                                custom_labels_replace(ls);
+                                for (unsigned i = 0; i < 100; ++i)
+                                        step(&ls, m, true, &rng);
+                                // Readers may still have the set after it's replaced,
+                                // so changing it then must not free what they read.
+                                custom_labels_replace(NULL);
+                                for (unsigned i = 0; i < 20; ++i)
+                                        step(&ls, m, false, &rng);
+                                custom_labels_free(ls);
+                        }
+                        reclaim_target = NULL;
+                        custom_labels_reclaim();
+                });
+                mutator.join();
+                reclaim_done = true;
+                r1.join();
+                r2.join();
+        }
+        custom_labels_reclaim_configure(0);
+}
+
+static void free_set(void *ls) {
+        custom_labels_free((custom_labels_labelset_t *)ls);
+}
+
+// Label sets freed by thread-specific data destructors, which run after
+// the library's thread-local state (the quarantine and the pool) has
+// gone, are still freed safely, with and without a quarantine.
+static void check_reclaim_at_exit() {
+        pthread_key_t key;
+        CHECK(!pthread_key_create(&key, free_set));
+        custom_labels_pool_configure(8, 1 << 20);
+        for (size_t max_bytes : { (size_t)0, (size_t)1 << 20 }) {
+                custom_labels_reclaim_configure(max_bytes);
+                std::thread([key] {
+                        custom_labels_labelset_t *ls = custom_labels_new(0);
+                        CHECK(!custom_labels_set(ls, str(keys[0]), str("before exit"), NULL));
+                        custom_labels_free(ls);
+                        ls = custom_labels_new(0);
+                        CHECK(!custom_labels_set(ls, str(keys[0]), str("at exit"), NULL));
+                        CHECK(!pthread_setspecific(key, ls));
+                }).join();
+        }
+        custom_labels_pool_configure(0, 0);
+        custom_labels_reclaim_configure(0);
+        pthread_key_delete(key);
+}
+
+static uint64_t generation(const custom_labels_labelset_t *ls) {
+        return ((const struct abi_labelset *)ls)->generation;
+}
+
+// Every change leaves a set with an even generation that neither it nor
+// any other set has had, however many changes it goes through.
+static void check_generations() {
+        std::set<uint64_t> seen;
+        custom_labels_labelset_t *sets[2] = { custom_labels_new(0), custom_labels_new(0) };
+        for (auto ls : sets)
+                CHECK(ls && seen.insert(generation(ls)).second);
+        for (unsigned i = 0; i < 2000; ++i) {
+                custom_labels_labelset_t *ls = sets[i % 3 == 0];
+                CHECK(!custom_labels_set(ls, str(keys[0]), str(std::to_string(i)), NULL));
+                CHECK(!(generation(ls) & 1) && seen.insert(generation(ls)).second);
+        }
+        for (auto ls : sets)
+                custom_labels_free(ls);
+}
+
+// Feeds the decoder mutated encodings. Each is decoded from a buffer of
+// exactly its size, so that sanitizers catch reads past the end.
+static void check_decode_fuzz(unsigned rounds) {
+        uint64_t rng = seed ^ 0x1234567;
+        for (unsigned round = 0; round < rounds * 50; ++round) {
+                custom_labels_labelset_t *src = custom_labels_new(0);
+                for (unsigned i = 0, n = xorshift(&rng) % 6; i < n; ++i)
+                        CHECK(!custom_labels_set(src, str(keys[random_key(&rng)]), str(random_value(&rng)), NULL));
+                std::string buf = encode(src);
+                custom_labels_free(src);
+                for (unsigned i = 0, n = 1 + xorshift(&rng) % 4; i < n; ++i) {
+                        uint64_t r = xorshift(&rng);
+                        size_t pos = buf.empty() ? 0 : (r >> 8) % buf.size();
+                        switch (r % 6) {
+                        case 0:
+                                if (!buf.empty())
+                                        buf[pos] ^= 1 << ((r >> 40) % 8);
+                                break;
+                        case 1:
+                                buf.resize(pos);
+                                break;
+                        case 2:
+                                buf.insert(pos, 1 + (r >> 40) % 8, (char)(r >> 48));
+                                break;
+                        case 3:
+                                // Overwrite what may be a length with something large.
+                                if (buf.size() >= pos + 4)
+                                        memcpy(&buf[pos], "\xff\xff\xff\x7f", 4);
+                                break;
+                        case 4:
+                                if (!buf.empty())
+                                        buf[pos] = (char)(r >> 40);
+                                break;
+                        case 5:
+                                buf += buf.substr(pos);
+                                break;
+                        }
+                }
+                unsigned char *exact = (unsigned char *)malloc(buf.size() + !buf.size());
+                memcpy(exact, buf.data(), buf.size());
+                model_t expected;
+                bool valid = reference_decode(buf, &expected);
+                custom_labels_labelset_t *ls = NULL;
+                unsigned flags = round % 2 ? CUSTOM_LABELS_KEY_BORROWED | CUSTOM_LABELS_VALUE_BORROWED : 0;
+                int error = custom_labels_decode(exact, buf.size(), flags, &ls);
+                CHECK(valid ? !error : error == EINVAL);
+                if (!error) {
+                        check_set(ls, expected);
+                        custom_labels_free(ls);
+                }
+                // Malformed encodings leave the set alone.
+                custom_labels_labelset_t *into = custom_labels_new(0);
+                CHECK(!custom_labels_set(into, str(keys[0]), str("kept"), NULL));
+                error = custom_labels_decode_into(into, exact, buf.size(), 0);
+                CHECK(valid ? !error : error == EINVAL);
+                if (error)
+                        check_set(into, model_t { { keys[0], { CUSTOM_LABELS_VALUE_BYTES, "kept" } } });
+                custom_labels_free(into);
+                free(exact);
+        }
+}
+
+int main(int argc, char **argv) {
+        unsigned rounds = 200;
+        seed = 0x9e3779b97f4a7c15ULL;
+        for (int i = 1; i < argc; ++i) {
+                const char *arg = argv[i];
+                if (!strncmp(arg, "--rounds=", 9)) {
+                        rounds = strtoul(arg + 9, NULL, 10);
+                } else if (!strncmp(arg, "--seed=", 7)) {
+                        seed = strtoull(arg + 7, NULL, 10);
+                        if (!seed)
+                                seed = 1;
+                } else {
+                        fprintf(stderr, "usage: %s [--rounds=N] [--seed=N]\n", argv[0]);
+                        return 2;
+                }
+        }
+
+        for (unsigned i = 0; i < N_KEYS; ++i) {
+                keys[i] = "key" + std::string(i % 7, 'x') + std::to_string(i / 7);
+                static_values[i] = "static" + std::to_string(i);
+                key_handles[i] = custom_labels_key_intern(str(keys[i]));
+                CHECK(key_handles[i]);
+                // Interning a key again gives the same handle.
+                CHECK(custom_labels_key_intern(str(keys[i])) == key_handles[i]);
+                CHECK(to_string(custom_labels_key_string(key_handles[i])) == keys[i]);
+        }
+
+        check_model(rounds);
+        check_generations();
+        check_frozen();
+        check_pool(rounds);
+        check_reclaim(rounds / 4 + 1);
+        check_reclaim_at_exit();
+        check_decode_fuzz(rounds);
+
+        // Every set was freed, including those of threads that have exited.
+        custom_labels_stats_t stats;
+        custom_labels_stats(&stats);
+        CHECK(stats.labelsets_created == stats.labelsets_freed);
+
+        printf("ok: %u rounds, seed %llu\n", rounds, (unsigned long long)seed);
+        return 0;
+}
@@ -0,0 +1,509 @@
+// A stand-in profiler for stress-testing the careful path.
+//
+// Each mutator thread installs a label set and changes it as fast as it
+// can (setting, deleting, pushing scopes, swapping in clones), while a
+// timer interrupts it with SIGPROF at a fixed rate. The signal handler
+// decodes `custom_labels_current_set` following the rules of
+// custom-labels-v2.md, just as an external profiler would, and checks
+// that every label it sees is well-formed: keys and values are generated
+// so that a torn or dangling read can be detected. Like a profiler, it
+// reads memory with `process_vm_readv`, so that following a bad pointer
+// shows up as an invalid read rather than a crash. It also checks what
+// `custom_labels_snapshot_current` returns from the same signal handler.
+// It caches what it read from each set by (set, generation), as the ABI
+// allows, and counts any cached read whose labels have since changed as
+// stale.
+//
+// It reports the mutation throughput for each sampling rate (0 meaning
+// no sampling) along with the numbers of samples, labels read, invalid
+// reads and stale reads, as JSON or CSV. It exits with a non-zero status if
+// any read was invalid or stale.
+//
+// In `detached` mode the same operations are done on a set that isn't
+// installed, so that they take the non-careful path; comparing it with
+// `current` mode gives the cost of the careful path.
+//
+// Usage: stress [--format=json|csv] [--threads=1,4] [--hz=0,100,1000,10000]
+//               [--modes=current,detached] [--seconds=N]
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "customlabels.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// The layout of a label set that profilers rely on.
+struct abi_labelset {
+        custom_labels_label_t *storage;
+        size_t count;
+        size_t capacity;
+        uint64_t generation;
+};
+
+#define N_KEYS 24
+#define MAX_VALUE_LEN 64
+// How many labels the batch mutations touch.
+#define BATCH 4
+// More labels than a set in this test can ever have.
+#define MAX_LABELS 256
+
+// Key `i` is "key<i>" followed by `i % 5` underscores, so that keys
+// have different lengths and a torn `len` shows up.
+static std::string key_string(unsigned i) {
+        return "key" + std::to_string(i) + std::string(i % 5, '_');
+}
+
+static std::string keys[N_KEYS];
+static custom_labels_key_t key_handles[N_KEYS];
+
+// The value of key `i` with version `v` is "<i>:<v>" followed by
+// `v % 11` dots and a '#', so that it can be checked on its own.
+static size_t format_value(unsigned char *buf, unsigned i, unsigned v) {
+        int n = snprintf((char *)buf, MAX_VALUE_LEN, "%u:%u", i, v);
+        for (unsigned j = 0; j < v % 11; ++j)
+                buf[n++] = '.';
+        buf[n++] = '#';
+        return n;
+}
+
+static custom_labels_string_t str(const std::string &s) {
+        return (custom_labels_string_t) { s.size(), (const unsigned char *)s.data() };
+}
+
+// Everything below, down to `on_sigprof`, runs in the signal handler,
+// so it sticks to reading memory and doing arithmetic.
+
+// Copies `n` bytes from `src` into `dst`, returning false if any of them can't be read.
+static bool read_mem(void *dst, const void *src, size_t n) {
+        struct iovec local = { dst, n };
+        struct iovec remote = { (void *)src, n };
+        return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)n;
+}
+
+// Parses a decimal number from `buf[*pos..len)`, returning false if there isn't one.
+static bool parse_uint(const unsigned char *buf, size_t len, size_t *pos, unsigned *out) {
+        size_t start = *pos;
+        unsigned n = 0;
+        while (*pos < len && buf[*pos] >= '0' && buf[*pos] <= '9')
+                n = n * 10 + (buf[(*pos)++] - '0');
+        *out = n;
+        return *pos > start;
+}
+
+// Returns the index of the key, or -1 if it isn't a valid key.
+static int check_key(const unsigned char *buf, size_t len) {
+        if (len < 4 || buf[0] != 'k' || buf[1] != 'e' || buf[2] != 'y')
+                return -1;
+        size_t pos = 3;
+        unsigned i;
+        if (!parse_uint(buf, len, &pos, &i) || i >= N_KEYS || len != pos + i % 5)
+                return -1;
+        for (; pos < len; ++pos)
+                if (buf[pos] != '_')
+                        return -1;
+        return i;
+}
+
+static bool check_value(const unsigned char *buf, size_t len, unsigned key) {
+        size_t pos = 0;
+        unsigned i, v;
+        if (!parse_uint(buf, len, &pos, &i) || i != key || pos >= len || buf[pos++] != ':')
+                return false;
+        if (!parse_uint(buf, len, &pos, &v) || len != pos + v % 11 + 1)
+                return false;
+        for (; pos < len - 1; ++pos)
+                if (buf[pos] != '.')
+                        return false;
+        return buf[pos] == '#';
+}
+
+struct reader_stats {
+        size_t samples;
+        size_t labels;
+        size_t duplicates;
+        size_t invalid;
+        size_t stale;
+};
+
+static thread_local struct reader_stats reader;
+
+// What was last read from a set with an even generation.
+struct cached_read {
+        const void *ls;
+        uint64_t generation;
+        uint64_t checksum;
+};
+
+static thread_local struct cached_read cache;
+
+// FNV-1a, for checksums of what was read.
+static uint64_t hash(const unsigned char *buf, size_t len) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < len; ++i) {
+                h ^= buf[i];
+                h *= 0x100000001b3ULL;
+        }
+        return h;
+}
+
+// Reads the current set the way an external profiler does.
+static void read_abi() {
+        const void *ls_ptr = custom_labels_current_set;
+        struct abi_labelset ls;
+        custom_labels_label_t storage[MAX_LABELS];
+        if (!ls_ptr)
+                return;
+        if (!read_mem(&ls, ls_ptr, sizeof(ls)) || ls.count > ls.capacity || ls.count > MAX_LABELS ||
+            !read_mem(storage, ls.storage, ls.count * sizeof(custom_labels_label_t))) {
+                ++reader.invalid;
+                return;
+        }
+        bool seen[N_KEYS] = {};
+        bool valid = true;
+        // Order doesn't matter, so the checksum is a sum.
+        uint64_t checksum = 0;
+        for (size_t i = 0; i < ls.count; ++i) {
+                unsigned char key_buf[MAX_VALUE_LEN], value_buf[MAX_VALUE_LEN];
+                // Labels with null keys are ignored.
+                if (!storage[i].key.buf)
+                        continue;
+                int key = -1;
+                if (storage[i].key.len <= MAX_VALUE_LEN && read_mem(key_buf, storage[i].key.buf, storage[i].key.len))
+                        key = check_key(key_buf, storage[i].key.len);
+                if (key < 0) {
+                        ++reader.invalid;
+                        valid = false;
+                        continue;
+                }
+                // So are later labels with the same key as an earlier one.
+                if (seen[key]) {
+                        ++reader.duplicates;
+                        continue;
+                }
+                seen[key] = true;
+                ++reader.labels;
+                custom_labels_string_t value = storage[i].value;
+                if (!value.buf || value.len > MAX_VALUE_LEN || !read_mem(value_buf, value.buf, value.len) ||
+                    !check_value(value_buf, value.len, key)) {
+                        ++reader.invalid;
+                        valid = false;
+                        continue;
+                }
+                checksum += hash(key_buf, storage[i].key.len) * 31 + hash(value_buf, value.len);
+        }
+        // A set with an odd generation is being changed, so what
+        // was read from it mustn't be cached.
+        if (!valid || ls.generation & 1)
+                return;
+        if (cache.ls == ls_ptr && cache.generation == ls.generation && cache.checksum != checksum)
+                ++reader.stale;
+        cache = (struct cached_read) { ls_ptr, ls.generation, checksum };
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Reads the current set the way an in-process sampler does,
+// with `custom_labels_snapshot_current`.
+static void read_snapshot() {
+        unsigned char buf[MAX_LABELS * (8 + 2 * MAX_VALUE_LEN)];
+        size_t len = custom_labels_snapshot_current(buf, sizeof(buf));
+        if (len < 6 || buf[0] != CUSTOM_LABELS_SNAPSHOT_VERSION || buf[1]) {
+                ++reader.invalid;
+                return;
+        }
+        bool seen[N_KEYS] = {};
+        size_t pos = 6;
+        for (uint32_t i = 0, n = get_u32(buf + 2); i < n; ++i) {
+                uint32_t key_len = get_u32(buf + pos);
+                int key = check_key(buf + pos + 4, key_len);
+                pos += 4 + key_len;
+                uint32_t value_len = get_u32(buf + pos);
+                if (key < 0 || seen[key] || !check_value(buf + pos + 4, value_len, key))
+                        ++reader.invalid;
+                else
+                        seen[key] = true;
+                pos += 4 + value_len;
+        }
+        if (pos != len)
+                ++reader.invalid;
+}
+
+static void on_sigprof(int) {
+        int saved_errno = errno;
+        ++reader.samples;
+        read_abi();
+        read_snapshot();
+        errno = saved_errno;
+}
+
+struct options {
+        const char *format;
+        std::vector<size_t> threads;
+        std::vector<size_t> hz;
+        std::vector<std::string> modes;
+        double seconds;
+};
+
+struct mutator_result {
+        size_t ops;
+        double elapsed_ns;
+        struct reader_stats reader;
+};
+
+static double now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+        uint64_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        return *state = x;
+}
+
+static void check(int error, const char *what) {
+        if (error) {
+                fprintf(stderr, "%s: %s\n", what, strerror(error));
+                exit(1);
+        }
+}
+
+static void *noop(void *data) {
+        return data;
+}
+
+// Does one random mutation of `ls`, or of the current set if `ls` is NULL.
+static void mutate(custom_labels_labelset_t **lsp, bool current, uint64_t *rng, unsigned *version) {
+        custom_labels_labelset_t *ls = *lsp;
+        uint64_t r = xorshift(rng);
+        unsigned key = (r >> 8) % N_KEYS;
+        unsigned char value[MAX_VALUE_LEN];
+        custom_labels_string_t v = { format_value(value, key, ++*version), value };
+        switch (r % 16) {
+        case 0: case 1: case 2: case 3: case 4:
+                check(custom_labels_set(ls, str(keys[key]), v, NULL), "custom_labels_set");
+                break;
+        case 5: case 6:
+                check(custom_labels_set_k(ls, key_handles[key], v, NULL), "custom_labels_set_k");
+                break;
+        case 7: {
+                // A batch of consecutive keys, with the first one repeated.
+                unsigned char values[BATCH][MAX_VALUE_LEN];
+                custom_labels_label_t lbls[BATCH + 1];
+                for (unsigned i = 0; i < BATCH; ++i) {
+                        unsigned k = (key + i) % N_KEYS;
+                        lbls[i].key = str(keys[k]);
+                        lbls[i].value = (custom_labels_string_t) { format_value(values[i], k, ++*version), values[i] };
+                }
+                lbls[BATCH] = (custom_labels_label_t) { str(keys[key]), v };
+                check(custom_labels_set_many(ls, lbls, BATCH + 1), "custom_labels_set_many");
+                break;
+        }
+        case 8: case 9:
+                custom_labels_delete(ls, str(keys[key]));
+                break;
+        case 10: {
+                custom_labels_string_t ks[BATCH];
+                for (unsigned i = 0; i < BATCH; ++i)
+                        ks[i] = str(keys[(key + 2 * i) % N_KEYS]);
+                custom_labels_delete_many(ls, ks, BATCH);
+                break;
+        }
+        case 11:
+                custom_labels_delete_k(ls, key_handles[key]);
+                break;
+        case 12: case 13:
+                if (current) {
+                        // A scope borrowing a stack buffer, with a change made inside it.
+                        custom_labels_label_t lbl = { str(keys[key]), v };
+                        check(custom_labels_run_with_replace(&lbl, 1, noop, NULL, NULL), "custom_labels_run_with_replace");
+                } else {
+                        check(custom_labels_set(ls, str(keys[key]), v, NULL), "custom_labels_set");
+                }
+                break;
+        case 14: {
+                // Swap in a clone of the set.
+                custom_labels_labelset_t *clone = custom_labels_clone_with_capacity(ls, custom_labels_count(ls) + 1);
+                if (!clone)
+                        check(errno, "custom_labels_clone_with_capacity");
+                if (current)
+                        custom_labels_replace(clone);
+                custom_labels_free(ls);
+                *lsp = clone;
+                break;
+        }
+        default:
+                if (custom_labels_count(ls) > N_KEYS / 2)
+                        custom_labels_delete(ls, str(keys[key]));
+                break;
+        }
+}
+
+static void run_mutator(bool current, size_t hz, double seconds, uint64_t seed, struct mutator_result *out) {
+        custom_labels_labelset_t *ls = custom_labels_new(N_KEYS);
+        if (!ls)
+                check(errno, "custom_labels_new");
+        if (current)
+                custom_labels_replace(ls);
+        reader = (struct reader_stats) {};
+
+        timer_t timer;
+        if (hz) {
+                struct sigevent sev = {};
+                sev.sigev_notify = SIGEV_THREAD_ID;
+                sev.sigev_signo = SIGPROF;
+                sev.sigev_notify_thread_id = syscall(SYS_gettid);
+                if (timer_create(CLOCK_MONOTONIC, &sev, &timer))
+                        check(errno, "timer_create");
+                long interval = 1000000000L / hz;
+                struct itimerspec its = { { interval / 1000000000L, interval % 1000000000L },
+                                          { interval / 1000000000L, interval % 1000000000L } };
+                if (timer_settime(timer, 0, &its, NULL))
+                        check(errno, "timer_settime");
+        }
+
+        uint64_t rng = seed;
+        unsigned version = 0;
+        size_t ops = 0;
+        double start = now_ns();
+        double deadline = start + seconds * 1e9;
+        double now;
+        do {
+                for (int i = 0; i < 1024; ++i)
+                        mutate(&ls, current, &rng, &version);
+                ops += 1024;
+        } while ((now = now_ns()) < deadline);
+
+        if (hz)
+                timer_delete(timer);
+        if (current)
+                custom_labels_replace(NULL);
+        custom_labels_free(ls);
+        out->ops = ops;
+        out->elapsed_ns = now - start;
+        out->reader = reader;
+}
+
+int main(int argc, char **argv) {
+        struct options o;
+        o.format = "json";
+        o.threads = { 1, 4 };
+        o.hz = { 0, 100, 1000, 10000 };
+        o.modes = { "current", "detached" };
+        o.seconds = 1;
+        for (int i = 1; i < argc; ++i) {
+                const char *arg = argv[i];
+                const char *eq = strchr(arg, '=');
+                if (strncmp(arg, "--", 2) || !eq)
+                        goto usage;
+                std::string name(arg + 2, eq);
+                std::string value(eq + 1);
+                std::vector<std::string> list;
+                for (size_t start = 0, end; start <= value.size(); start = end + 1) {
+                        end = value.find(',', start);
+                        if (end == std::string::npos)
+                                end = value.size();
+                        list.push_back(value.substr(start, end - start));
+                }
+                if (name == "format" && (value == "json" || value == "csv")) {
+                        o.format = eq + 1;
+                } else if (name == "threads" || name == "hz") {
+                        std::vector<size_t> &out = name == "threads" ? o.threads : o.hz;
+                        out.clear();
+                        for (auto &s : list)
+                                out.push_back(strtoul(s.c_str(), NULL, 10));
+                } else if (name == "modes") {
+                        for (auto &s : list)
+                                if (s != "current" && s != "detached")
+                                        goto usage;
+                        o.modes = list;
+                } else if (name == "seconds") {
+                        o.seconds = strtod(value.c_str(), NULL);
+                } else {
+                        goto usage;
+                }
+        }
+
+        {
+                for (unsigned i = 0; i < N_KEYS; ++i) {
+                        keys[i] = key_string(i);
+                        key_handles[i] = custom_labels_key_intern(str(keys[i]));
+                        if (!key_handles[i])
+                                check(errno, "custom_labels_key_intern");
+                }
+                struct sigaction sa = {};
+                sa.sa_handler = on_sigprof;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                sigaction(SIGPROF, &sa, NULL);
+
+                bool csv = !strcmp(o.format, "csv");
+                bool first = true;
+                size_t total_invalid = 0;
+                if (csv)
+                        printf("mode,threads,hz,ops,mops_per_s,samples,labels_read,duplicates,invalid,stale\n");
+                for (auto &mode : o.modes)
+                        for (size_t n_threads : o.threads)
+                                for (size_t hz : o.hz) {
+                                        std::vector<struct mutator_result> results(n_threads);
+                                        std::vector<std::thread> threads;
+                                        for (size_t t = 0; t < n_threads; ++t)
+                                                threads.emplace_back(run_mutator, mode == "current", hz, o.seconds,
+                                                                     0x9e3779b97f4a7c15ULL * (t + 1), &results[t]);
+                                        for (auto &t : threads)
+                                                t.join();
+                                        struct mutator_result sum = {};
+                                        for (auto &r : results) {
+                                                sum.ops += r.ops;
+                                                sum.elapsed_ns += r.elapsed_ns;
+                                                sum.reader.samples += r.reader.samples;
+                                                sum.reader.labels += r.reader.labels;
+                                                sum.reader.duplicates += r.reader.duplicates;
+                                                sum.reader.invalid += r.reader.invalid;
+                                                sum.reader.stale += r.reader.stale;
+                                        }
+                                        total_invalid += sum.reader.invalid + sum.reader.stale;
+                                        // Throughput across all threads, from the mean time each ran for.
+                                        double mops = sum.ops / (sum.elapsed_ns / n_threads) * 1e3;
+                                        if (csv)
+                                                printf("%s,%zu,%zu,%zu,%.3f,%zu,%zu,%zu,%zu,%zu\n", mode.c_str(), n_threads, hz,
+                                                       sum.ops, mops, sum.reader.samples, sum.reader.labels,
+                                                       sum.reader.duplicates, sum.reader.invalid, sum.reader.stale);
+                                        else
+                                                printf("%s\n  {\"mode\": \"%s\", \"threads\": %zu, \"hz\": %zu, \"ops\": %zu, "
+                                                       "\"mops_per_s\": %.3f, \"samples\": %zu, \"labels_read\": %zu, "
+                                                       "\"duplicates\": %zu, \"invalid\": %zu, \"stale\": %zu}",
+                                                       first ? "[" : ",", mode.c_str(), n_threads, hz, sum.ops, mops,
+                                                       sum.reader.samples, sum.reader.labels, sum.reader.duplicates,
+                                                       sum.reader.invalid, sum.reader.stale);
+                                        first = false;
+                                        fflush(stdout);
+                                }
+                if (!csv)
+                        printf("%s\n", first ? "[]" : "\n]");
+                return total_invalid ? 1 : 0;
+        }
+
+usage:
+        fprintf(stderr, "usage: stress [--format=json|csv] [--threads=1,4] [--hz=0,100,1000,10000]\n"
+                        "              [--modes=current,detached] [--seconds=N]\n");
+        return 2;
+}
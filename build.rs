@@ -2,13 +2,15 @@ fn main() {
     println!("cargo:rerun-if-changed=src/customlabels.cpp");
     println!("cargo:rerun-if-changed=./build.rs");
     println!("cargo:rerun-if-changed=src/customlabels.h");
+    println!("cargo:rerun-if-changed=src/util.h");
     println!("cargo:rerun-if-changed=./dlist");
 
-    cc::Build::new()
-        .file("src/customlabels.cpp")
-        .std("c++17")
-        .cpp(true)
-        .compile("customlabels");
+    let mut build = cc::Build::new();
+    build.file("src/customlabels.cpp").std("c++17").cpp(true);
+    if std::env::var_os("CARGO_FEATURE_USDT").is_some() {
+        build.define("CUSTOM_LABELS_USDT", None);
+    }
+    build.compile("customlabels");
 
     println!("cargo:rustc-link-lib=static=customlabels");
     println!("cargo:rustc-link-arg=-Wl,--dynamic-list=./dlist");
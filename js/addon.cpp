@@ -2,6 +2,7 @@
 #include "native/customlabels.h"
 
 #include <node.h>
+#include <node_buffer.h>
 #include <node_object_wrap.h>
 #include <v8-internal.h>
 
@@ -10,6 +11,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <utility>
+#include <vector>
+
 extern "C" {
 using v8::Global;
 using v8::Object;
@@ -58,6 +62,244 @@ static bool ToLabelString(Local<Context> context, Local<Value> value,
   return value->ToString(context).ToLocal(out);
 }
 
+// Label keys are almost always the same handful of string literals,
+// which V8 internalizes, so each thread (and thus each isolate) keeps a
+// direct-mapped cache from key strings, by identity, to interned native
+// keys. A string is only interned the second time it's seen, so that
+// keys built afresh for every call don't pile up in the process-wide
+// intern table.
+#define KEY_CACHE_SIZE 256
+
+struct KeyCacheEntry {
+  Global<String> str;
+  // NULL until `str` has been seen a second time.
+  custom_labels_key_t key;
+};
+
+struct ThreadCache {
+  KeyCacheEntry keys[KEY_CACHE_SIZE];
+  // Reused for encoding keys and values, so that they needn't be
+  // allocated for every label.
+  std::vector<unsigned char> key_buf;
+  std::vector<unsigned char> value_buf;
+  // The class of ClTemplate objects, shared by every context of the
+  // isolate, for telling them apart from other wrapped objects.
+  Global<FunctionTemplate> template_class;
+};
+
+static thread_local ThreadCache *thread_cache;
+
+static void DeleteThreadCache(void *) {
+  delete thread_cache;
+  thread_cache = nullptr;
+}
+
+// Writes `n` as decimal into `buf`, which must have room for 11 bytes,
+// returning the length. This matches how JS formats integers.
+static size_t FormatInt32(unsigned char *buf, int32_t n) {
+  unsigned char digits[10];
+  size_t n_digits = 0;
+  uint32_t u = n < 0 ? -(uint32_t)n : n;
+  do {
+    digits[n_digits++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  size_t len = 0;
+  if (n < 0)
+    buf[len++] = '-';
+  while (n_digits)
+    buf[len++] = digits[--n_digits];
+  return len;
+}
+
+// Encodes `value` as UTF-8 into `scratch` in one pass (or points at a
+// constant for booleans, null and undefined), without measuring it
+// first. One-byte strings are copied out as they are and only
+// transcoded if they turn out to hold non-ASCII characters.
+static bool EncodeLabelString(Isolate *isolate, Local<Context> context,
+                              Local<Value> value,
+                              std::vector<unsigned char> *scratch,
+                              custom_labels_string_t *out) {
+  if (value->IsTrue()) {
+    *out = {4, (const unsigned char *)"true"};
+    return true;
+  }
+  if (value->IsFalse()) {
+    *out = {5, (const unsigned char *)"false"};
+    return true;
+  }
+  if (value->IsUndefined()) {
+    *out = {9, (const unsigned char *)"undefined"};
+    return true;
+  }
+  if (value->IsNull()) {
+    *out = {4, (const unsigned char *)"null"};
+    return true;
+  }
+  if (value->IsInt32()) {
+    if (scratch->size() < 11)
+      scratch->resize(11);
+    *out = {FormatInt32(scratch->data(), value.As<v8::Int32>()->Value()),
+            scratch->data()};
+    return true;
+  }
+
+  Local<String> str;
+  if (!ToLabelString(context, value, &str))
+    return false;
+  size_t len = str->Length();
+  // An empty scratch vector has no data, and a null buffer would mean
+  // a missing value rather than an empty one.
+  if (!len) {
+    *out = {0, (const unsigned char *)""};
+    return true;
+  }
+  if (str->IsOneByte()) {
+    // Latin-1 takes at most two bytes per character in UTF-8. Copy the
+    // string into the upper half, then transcode it downwards if need be;
+    // the output never overtakes the input.
+    if (scratch->size() < 2 * len)
+      scratch->resize(2 * len);
+    unsigned char *buf = scratch->data();
+    unsigned char *in = buf + len;
+    str->WriteOneByte(isolate, in, 0, len, String::NO_NULL_TERMINATION);
+    size_t out_len = 0;
+    for (size_t i = 0; i < len; ++i) {
+      unsigned char c = in[i];
+      if (c < 0x80) {
+        buf[out_len++] = c;
+      } else {
+        buf[out_len++] = 0xc0 | c >> 6;
+        buf[out_len++] = 0x80 | (c & 0x3f);
+      }
+    }
+    *out = {out_len, buf};
+    return true;
+  }
+  // Each UTF-16 code unit takes at most three bytes in UTF-8.
+  if (scratch->size() < 3 * len)
+    scratch->resize(3 * len);
+  int written = str->WriteUtf8(isolate, (char *)scratch->data(), 3 * len,
+                               nullptr, String::NO_NULL_TERMINATION);
+  *out = {(size_t)written, scratch->data()};
+  return true;
+}
+
+// Returns the interned key for `value` if it's a string that has been
+// seen before, or NULL after encoding it into `*out` otherwise.
+static bool LookupKey(Isolate *isolate, Local<Context> context,
+                      Local<Value> value, ThreadCache *cache,
+                      custom_labels_key_t *key_out,
+                      custom_labels_string_t *out) {
+  *key_out = nullptr;
+  KeyCacheEntry *entry = nullptr;
+  if (value->IsString()) {
+    Local<String> str = value.As<String>();
+    entry = &cache->keys[str->GetIdentityHash() & (KEY_CACHE_SIZE - 1)];
+    if (entry->str == str && entry->key) {
+      *key_out = entry->key;
+      return true;
+    }
+  }
+  if (!EncodeLabelString(isolate, context, value, &cache->key_buf, out))
+    return false;
+  if (!entry)
+    return true;
+  if (entry->str == value.As<String>()) {
+    // If interning fails, the key is simply copied in.
+    entry->key = custom_labels_key_intern(*out);
+    *key_out = entry->key;
+  } else {
+    entry->str.Reset(isolate, value.As<String>());
+    entry->key = nullptr;
+  }
+  return true;
+}
+
+// A fixed list of label keys, validated and interned once, for
+// `new ClWrap(old, template, ...values)` to pair with values.
+class ClTemplate : public ObjectWrap {
+public:
+  static void Init(Local<Object> exports);
+  // Returns the template `value` wraps, or NULL if it isn't one.
+  static ClTemplate *FromValue(Isolate *isolate, Local<Value> value);
+
+  std::vector<custom_labels_key_t> keys_;
+
+private:
+  static void New(const v8::FunctionCallbackInfo<v8::Value> &args);
+  ClTemplate() {}
+};
+
+ClTemplate *ClTemplate::FromValue(Isolate *isolate, Local<Value> value) {
+  if (!thread_cache->template_class.Get(isolate)->HasInstance(value))
+    return nullptr;
+  return ObjectWrap::Unwrap<ClTemplate>(value.As<Object>());
+}
+
+void ClTemplate::New(const v8::FunctionCallbackInfo<v8::Value> &args) {
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  if (!args.IsConstructCall()) [[unlikely]] {
+    isolate->ThrowError("Must be called like `new ClTemplate(k*)`");
+    return;
+  }
+
+  auto me = std::unique_ptr<ClTemplate>(new ClTemplate());
+  me->keys_.reserve(args.Length());
+  for (int i = 0; i < args.Length(); ++i) {
+    if (!IsAllowedLabelValue(args[i])) {
+      isolate->ThrowError(
+          "Keys must be strings, booleans, numbers, null, or undefined");
+      return;
+    }
+    custom_labels_string_t key;
+    if (!EncodeLabelString(isolate, context, args[i], &thread_cache->key_buf,
+                           &key)) {
+      isolate->ThrowError("Failed to convert label to string");
+      return;
+    }
+    // Templates are meant for the fixed label shapes used over and
+    // over, so their keys are interned right away.
+    custom_labels_key_t interned = custom_labels_key_intern(key);
+    if (!interned) {
+      isolate->ThrowError("allocation failed");
+      return;
+    }
+    me->keys_.push_back(interned);
+  }
+
+  me.release()->Wrap(args.This());
+  args.GetReturnValue().Set(args.This());
+}
+
+void ClTemplate::Init(Local<Object> exports) {
+#if NODE_MAJOR_VERSION >= 26
+  Isolate *isolate = Isolate::GetCurrent();
+#else
+  Isolate *isolate = exports->GetIsolate();
+#endif
+  Local<Context> context = isolate->GetCurrentContext();
+
+  Local<FunctionTemplate> tpl;
+  if (thread_cache->template_class.IsEmpty()) {
+    tpl = FunctionTemplate::New(isolate, New);
+    tpl->SetClassName(
+        String::NewFromUtf8(isolate, "ClTemplate").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    thread_cache->template_class.Reset(isolate, tpl);
+  } else {
+    tpl = thread_cache->template_class.Get(isolate);
+  }
+
+  Local<Function> constructor = tpl->GetFunction(context).ToLocalChecked();
+  exports
+      ->Set(context, String::NewFromUtf8(isolate, "ClTemplate").ToLocalChecked(),
+            constructor)
+      .FromJust();
+}
+
 // Wrapper around a custom_labels_labelset_t,
 // with lifetime managed by the V8 GC.
 class ClWrap : public ObjectWrap {
@@ -72,7 +314,9 @@ public:
 
 private:
   static void New(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void FromEncoded(const v8::FunctionCallbackInfo<v8::Value> &args);
   static void ToString(const v8::FunctionCallbackInfo<v8::Value> &args);
+  static void Encode(const v8::FunctionCallbackInfo<v8::Value> &args);
   custom_labels_labelset_t *underlying_;
   // Homemade RTTI. If the bytes at this address equal
   // CLWRAP_TOKEN_VALUE, the agent knows it's looking at
@@ -94,12 +338,28 @@ void ClWrap::New(const v8::FunctionCallbackInfo<v8::Value> &args) {
     isolate->ThrowError("Must be called like `new ClWrap(old, (k, v)*`");
     return;
   }
-  if (args.Length() % 2 == 0) {
-    isolate->ThrowError("Must be called like `new ClWrap(old, (k, v)*)`");
-    return;
-  }
 
-  size_t new_labels = args.Length() / 2;
+  // Called either as `new ClWrap(old, template, v*)`, with a value
+  // for each of the template's keys, or as below. Encoded labels go
+  // through `ClWrap.fromEncoded` instead.
+  ClTemplate *tpl =
+      args.Length() >= 2 ? ClTemplate::FromValue(isolate, args[1]) : nullptr;
+  size_t new_labels;
+  if (tpl) {
+    new_labels = tpl->keys_.size();
+    if ((size_t)args.Length() != 2 + new_labels) {
+      isolate->ThrowError(
+          "Must be called like `new ClWrap(old, template, v*)` with one "
+          "value per key of the template");
+      return;
+    }
+  } else {
+    if (args.Length() % 2 == 0) {
+      isolate->ThrowError("Must be called like `new ClWrap(old, (k, v)*)`");
+      return;
+    }
+    new_labels = args.Length() / 2;
+  }
 
   // args[0] is the old ls, args[n+1] is the nth key, args[n+2] is the nth
   // value.
@@ -139,6 +399,31 @@ void ClWrap::New(const v8::FunctionCallbackInfo<v8::Value> &args) {
 
   ClWrap *new_ = new ClWrap(underlying);
   auto me = std::unique_ptr<ClWrap>(new_);
+  ThreadCache *cache = thread_cache;
+
+  if (tpl) {
+    for (size_t i = 0; i < new_labels; ++i) {
+      custom_labels_string_t value;
+      if (!IsAllowedLabelValue(args[i + 2])) {
+        isolate->ThrowError("Values must be strings, booleans, numbers, "
+                            "null, or undefined");
+        return;
+      }
+      if (!EncodeLabelString(isolate, context, args[i + 2],
+                             &cache->value_buf, &value)) {
+        isolate->ThrowError("Failed to convert label to string");
+        return;
+      }
+      if (custom_labels_set_k(underlying, tpl->keys_[i], value, nullptr)) {
+        isolate->ThrowError("Underlying custom_labels_set_k call failed: "
+                            "probably an allocation error.");
+        return;
+      }
+    }
+    me.release()->Wrap(args.This());
+    args.GetReturnValue().Set(args.This());
+    return;
+  }
 
   for (size_t i = 0; i < new_labels; ++i) {
     int k_idx = 2 * i + 1;
@@ -151,28 +436,19 @@ void ClWrap::New(const v8::FunctionCallbackInfo<v8::Value> &args) {
       return;
     }
 
-    Local<String> k;
-    Local<String> v;
-    if (!ToLabelString(context, args[k_idx], &k) ||
-        !ToLabelString(context, args[v_idx], &v)) {
+    custom_labels_key_t interned;
+    custom_labels_string_t key;
+    custom_labels_string_t value;
+    if (!LookupKey(isolate, context, args[k_idx], cache, &interned, &key) ||
+        !EncodeLabelString(isolate, context, args[v_idx], &cache->value_buf,
+                           &value)) {
       isolate->ThrowError("Failed to convert label to string");
       return;
     }
 
-    int k_len = k->Utf8Length(isolate);
-    auto k_buf = std::make_unique<char[]>(k_len);
-
-    int v_len = v->Utf8Length(isolate);
-    auto v_buf = std::make_unique<char[]>(v_len);
-
-    k->WriteUtf8(isolate, k_buf.get(), k_len, nullptr,
-                 String::NO_NULL_TERMINATION);
-    v->WriteUtf8(isolate, v_buf.get(), v_len, nullptr,
-                 String::NO_NULL_TERMINATION);
-
-    custom_labels_string_t key{(size_t)k_len, (unsigned char *)k_buf.get()};
-    custom_labels_string_t value{(size_t)v_len, (unsigned char *)v_buf.get()};
-    int err = custom_labels_set(underlying, key, value, nullptr);
+    int err = interned
+                  ? custom_labels_set_k(underlying, interned, value, nullptr)
+                  : custom_labels_set(underlying, key, value, nullptr);
 
     if (err) {
       // TODO - better error message here.
@@ -187,6 +463,45 @@ void ClWrap::New(const v8::FunctionCallbackInfo<v8::Value> &args) {
   args.GetReturnValue().Set(args.This());
 }
 
+// Called as `ClWrap.fromEncoded(old, encoded)`, with labels encoded by
+// `encode`. It's a separate function, rather than a form of `new ClWrap`,
+// so that no other call can be mistaken for it.
+void ClWrap::FromEncoded(const v8::FunctionCallbackInfo<v8::Value> &args) {
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+
+  if (args.Length() != 2 || !args[1]->IsArrayBufferView()) {
+    isolate->ThrowError("Must be called like `ClWrap.fromEncoded(old, "
+                        "encoded)` with a Buffer");
+    return;
+  }
+
+  // Start from a copy of `old`; the decoded labels make room for
+  // themselves.
+  Local<Function> constructor =
+      args.Data().As<Object>()->GetInternalField(0).As<Value>().As<Function>();
+  Local<Value> argv[] = {args[0]};
+  Local<Object> obj;
+  if (!constructor->NewInstance(context, 1, argv).ToLocal(&obj))
+    return;
+  ClWrap *wrap = ObjectWrap::Unwrap<ClWrap>(obj);
+
+  // The labels are copied, since the buffer may be reused.
+  int err = custom_labels_decode_into(wrap->underlying_,
+                                      node::Buffer::Data(args[1]),
+                                      node::Buffer::Length(args[1]), 0);
+  if (err == EINVAL) {
+    isolate->ThrowError("Invalid encoded labels");
+    return;
+  }
+  if (err) {
+    isolate->ThrowError("Underlying custom_labels_decode_into call failed: "
+                        "probably an allocation error.");
+    return;
+  }
+  args.GetReturnValue().Set(obj);
+}
+
 void ClWrap::ToString(const v8::FunctionCallbackInfo<v8::Value> &args) {
   Isolate *isolate = args.GetIsolate();
 
@@ -214,6 +529,29 @@ void ClWrap::ToString(const v8::FunctionCallbackInfo<v8::Value> &args) {
   args.GetReturnValue().Set(js_string);
 }
 
+// Returns the labels encoded by `custom_labels_encode_into`, as a Buffer.
+void ClWrap::Encode(const v8::FunctionCallbackInfo<v8::Value> &args) {
+  Isolate *isolate = args.GetIsolate();
+
+  ClWrap *obj = ObjectWrap::Unwrap<ClWrap>(args.This());
+  if (!obj) {
+    isolate->ThrowError("Invalid ClWrap object");
+    return;
+  }
+
+  std::vector<unsigned char> &buf = thread_cache->value_buf;
+  size_t len = custom_labels_encode_into(obj->underlying_, buf.data(),
+                                         buf.size());
+  if (len > buf.size()) {
+    buf.resize(len);
+    custom_labels_encode_into(obj->underlying_, buf.data(), buf.size());
+  }
+
+  args.GetReturnValue().Set(
+      node::Buffer::Copy(isolate, (const char *)buf.data(), len)
+          .ToLocalChecked());
+}
+
 void ClWrap::Init(Local<Object> exports) {
 #if NODE_MAJOR_VERSION >= 26
   Isolate *isolate = Isolate::GetCurrent();
@@ -222,6 +560,13 @@ void ClWrap::Init(Local<Object> exports) {
 #endif
   Local<Context> context = isolate->GetCurrentContext();
 
+  // The addon may be loaded more than once per thread (e.g. into
+  // several contexts), but the cache only depends on the isolate.
+  if (!thread_cache) {
+    thread_cache = new ThreadCache();
+    node::AddEnvironmentCleanupHook(isolate, DeleteThreadCache, nullptr);
+  }
+
   Local<ObjectTemplate> addon_data_tpl = ObjectTemplate::New(isolate);
   addon_data_tpl->SetInternalFieldCount(1); // 1 field for the ClWrap::New()
   Local<Object> addon_data =
@@ -236,6 +581,12 @@ void ClWrap::Init(Local<Object> exports) {
   tpl->PrototypeTemplate()->Set(
       String::NewFromUtf8(isolate, "toString").ToLocalChecked(),
       FunctionTemplate::New(isolate, ToString));
+  tpl->PrototypeTemplate()->Set(
+      String::NewFromUtf8(isolate, "encode").ToLocalChecked(),
+      FunctionTemplate::New(isolate, Encode));
+
+  tpl->Set(String::NewFromUtf8(isolate, "fromEncoded").ToLocalChecked(),
+           FunctionTemplate::New(isolate, FromEncoded, addon_data));
 
   Local<Function> constructor = tpl->GetFunction(context).ToLocalChecked();
   addon_data->SetInternalField(0, constructor);
@@ -269,12 +620,44 @@ void GetStoredHash(const v8::FunctionCallbackInfo<v8::Value> &args) {
   args.GetReturnValue().Set(ret);
 }
 
+// Returns the library's counters (see `custom_labels_stats`) as an
+// object with camel-cased names, plus the number of live label sets.
+void Stats(const v8::FunctionCallbackInfo<v8::Value> &args) {
+  Isolate *isolate = args.GetIsolate();
+  Local<Context> context = isolate->GetCurrentContext();
+  custom_labels_stats_t stats;
+  custom_labels_stats(&stats);
+  const std::pair<const char *, uint64_t> fields[] = {
+      {"labelsSet", stats.labels_set},
+      {"labelsDeleted", stats.labels_deleted},
+      {"replaces", stats.replaces},
+      {"carefulOps", stats.careful_ops},
+      {"reallocations", stats.reallocations},
+      {"allocations", stats.allocations},
+      {"bytesAllocated", stats.bytes_allocated},
+      {"labelsetsCreated", stats.labelsets_created},
+      {"labelsetsFreed", stats.labelsets_freed},
+      {"liveLabelsets", stats.labelsets_created - stats.labelsets_freed},
+      {"keysInterned", stats.keys_interned},
+      {"setsInterned", stats.sets_interned},
+  };
+  Local<Object> ret = Object::New(isolate);
+  for (const auto &[name, value] : fields) {
+    ret->Set(context, String::NewFromUtf8(isolate, name).ToLocalChecked(),
+             v8::Number::New(isolate, static_cast<double>(value)))
+        .Check();
+  }
+  args.GetReturnValue().Set(ret);
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-function-type"
 
 NODE_MODULE_INIT() {
   ClWrap::Init(exports);
+  ClTemplate::Init(exports);
   NODE_SET_METHOD(exports, "storeHash", StoreHash);
+  NODE_SET_METHOD(exports, "stats", Stats);
 }
 } // namespace custom_labels
 
@@ -3,3 +3,30 @@ export type LabelValue = string | boolean | number | null | undefined;
 export function withLabels<T>(f: () => T, ...kvs: LabelValue[]): T;
 
 export function curLabels(): Record<string, string> | undefined;
+
+export interface LabelTemplate {
+    run<T>(f: () => T, ...values: LabelValue[]): T;
+}
+
+export function labelTemplate(keys: readonly LabelValue[]): LabelTemplate;
+
+export function encodeLabels(): Buffer | undefined;
+
+export function withEncodedLabels<T>(f: () => T, encoded: Uint8Array): T;
+
+export interface LabelStats {
+    labelsSet: number;
+    labelsDeleted: number;
+    replaces: number;
+    carefulOps: number;
+    reallocations: number;
+    allocations: number;
+    bytesAllocated: number;
+    labelsetsCreated: number;
+    labelsetsFreed: number;
+    liveLabelsets: number;
+    keysInterned: number;
+    setsInterned: number;
+}
+
+export function stats(): LabelStats | undefined;
@@ -1,5 +1,9 @@
 let withLabels;
 let curLabels;
+let labelTemplate;
+let stats;
+let encodeLabels;
+let withEncodedLabels;
 
 let hook;
 
@@ -51,13 +55,86 @@ if (process.platform == 'linux') {
         const newLabels = new addon.ClWrap(curs, ...kvs);
         return als.run(newLabels, f);
     };
+
+    labelTemplate = function(keys) {
+        const tpl = new addon.ClTemplate(...keys);
+        const n = keys.length;
+        // Fixed-arity versions for the common shapes, so that values
+        // aren't gathered into an array on every call.
+        let run;
+        switch (n) {
+        case 1:
+            run = function(f, v0) {
+                ensureHook();
+                return als.run(new addon.ClWrap(als.getStore(), tpl, v0), f);
+            };
+            break;
+        case 2:
+            run = function(f, v0, v1) {
+                ensureHook();
+                return als.run(new addon.ClWrap(als.getStore(), tpl, v0, v1), f);
+            };
+            break;
+        case 3:
+            run = function(f, v0, v1, v2) {
+                ensureHook();
+                return als.run(new addon.ClWrap(als.getStore(), tpl, v0, v1, v2), f);
+            };
+            break;
+        case 4:
+            run = function(f, v0, v1, v2, v3) {
+                ensureHook();
+                return als.run(new addon.ClWrap(als.getStore(), tpl, v0, v1, v2, v3), f);
+            };
+            break;
+        default:
+            run = function(f, ...values) {
+                ensureHook();
+                // Missing values are labeled "undefined", as they are above.
+                values.length = n;
+                return als.run(new addon.ClWrap(als.getStore(), tpl, ...values), f);
+            };
+        }
+        return { run };
+    };
+
+    stats = function() {
+        return addon.stats();
+    };
+
+    encodeLabels = function() {
+        ensureHook();
+        const curs = als.getStore();
+        return curs === undefined ? undefined : curs.encode();
+    };
+
+    withEncodedLabels = function(f, encoded) {
+        ensureHook();
+        return als.run(addon.ClWrap.fromEncoded(als.getStore(), encoded), f);
+    };
 } else {
     withLabels = function(f, ...kvs) {
         return f();
     };
 
     curLabels = function() { return undefined; };
+
+    labelTemplate = function(keys) {
+        return { run: function(f) { return f(); } };
+    };
+
+    stats = function() { return undefined; };
+
+    encodeLabels = function() { return undefined; };
+
+    withEncodedLabels = function(f, encoded) {
+        return f();
+    };
 }
 
 exports.withLabels = withLabels;
 exports.curLabels = curLabels;
+exports.labelTemplate = labelTemplate;
+exports.stats = stats;
+exports.encodeLabels = encodeLabels;
+exports.withEncodedLabels = withEncodedLabels;
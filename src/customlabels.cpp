@@ -3,40 +3,612 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "customlabels.h"
+#include "customlabels_inline.h"
 #include "util.h"
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 
 extern "C" {
   __attribute__((retain))
-    uint32_t custom_labels_abi_version = 1;
+    uint32_t custom_labels_abi_version = 2;
 }
 
+// A label set keeps its `storage` array and the bytes of all of its
+// keys and values in a single allocation, laid out as follows:
+//
+//   struct block | custom_labels_label_t[capacity] | flags[capacity] | fingerprints[FP_ROUND(capacity)] | bytes[size]
+//
+// `flags` holds a few bits of bookkeeping for each label in `storage`,
+// and `fingerprints` a byte of the hash of its key (see `get_mut`);
+// both must move together with it.
+//
+// Key and value bytes are bump-allocated from `bytes`. Deleting or
+// overwriting a label leaves its bytes behind as garbage, which is
+// reclaimed the next time the set runs out of room and is moved to
+// a fresh, compacted block (see `relocate`).
+//
+// Blocks are reference-counted so that clones can share their bytes
+// rather than copying them: a clone's labels may point into the bytes
+// of the original's block, which the clone's block holds a reference
+// to as its `parent`, and so on up the chain. Bytes are never modified
+// once handed out unless the block is exclusively owned.
+struct block {
+        size_t refcount;
+        struct block *parent;
+        // The length of the chain of parents.
+        unsigned depth;
+        unsigned char *flags;
+        unsigned char *fingerprints;
+        unsigned char *bytes;
+        size_t size;
+        size_t used;
+        size_t garbage;
+        // The block's memory belongs to someone else
+        // (e.g., it's on the stack) and must not be freed.
+        bool borrowed;
+};
+
 struct _custom_labels_ls {
+  // The first four fields are read by profilers and
+  // their layout is fixed by the ABI.
   custom_labels_label_t *storage;
   size_t count;
   size_t capacity;
+  // Odd while the set is being changed, and different after every
+  // change; the upper 32 bits differ between every set ever created.
+  // See custom-labels-v2.md.
+  uint64_t generation;
+  // The flags of the labels in `storage`, whose `LABEL_VALUE_TYPE`
+  // bits profilers read if they know about `custom_labels_typed_values_version`;
+  // always the `flags` of `block`.
+  const unsigned char *tags;
+  // NULL until the set first needs room for a label.
+  struct block *block;
+  // The next set in the pool, while the set is pooled.
+  custom_labels_labelset_t *pool_next;
+  // NULL until the set has been looked up in with at least
+  // `INDEX_MIN_LABELS` labels (see `struct index`).
+  struct index *index;
+  // The ID of the set's labels (see `custom_labels_intern_set`),
+  // or 0 if they haven't been interned since they last changed.
+  uint64_t id;
+  // 0 while the set can be changed; once it's frozen (see
+  // `custom_labels_freeze`), the number of references to it.
+  size_t refs;
+  // Nonzero if readers on other threads may still be looking at the
+  // set after it stopped being current (see `published`).
+  uint64_t unpublished;
 };
 
+// customlabels_inline.h reads and writes these fields directly.
+#define PREFIX_MATCHES(field) \
+        (offsetof(struct _custom_labels_ls, field) == offsetof(struct _custom_labels_ls_prefix, field))
+static_assert(PREFIX_MATCHES(storage) && PREFIX_MATCHES(count) && PREFIX_MATCHES(capacity) &&
+              PREFIX_MATCHES(generation) && PREFIX_MATCHES(tags) && PREFIX_MATCHES(block) &&
+              PREFIX_MATCHES(pool_next) && PREFIX_MATCHES(index) && PREFIX_MATCHES(id) &&
+              PREFIX_MATCHES(refs) && PREFIX_MATCHES(unpublished),
+              "customlabels_inline.h is out of date");
+
+// Frozen sets may be shared between threads, which count
+// their references atomically.
+static bool frozen(const custom_labels_labelset_t *ls) {
+        return __atomic_load_n(&ls->refs, __ATOMIC_RELAXED);
+}
+
+// Label flags, saying where a label's key and value live.
+// Strings with none of these flags set live in the set's block.
+//
+// The key is interned (see `custom_labels_key_intern`),
+// and its `buf` points at the interned copy.
+#define LABEL_KEY_INTERNED 0x1
+// The key or value was handed over by the caller and is freed
+// along with the label.
+#define LABEL_KEY_OWNED 0x2
+#define LABEL_VALUE_OWNED 0x4
+// The key or value belongs to the caller, who guarantees it
+// outlives the label.
+#define LABEL_KEY_BORROWED 0x8
+#define LABEL_VALUE_BORROWED 0x10
+
+#define LABEL_KEY_BY_POINTER (LABEL_KEY_INTERNED | LABEL_KEY_OWNED | LABEL_KEY_BORROWED)
+#define LABEL_VALUE_BY_POINTER (LABEL_VALUE_OWNED | LABEL_VALUE_BORROWED)
+
+// The type of the value, which profilers read (see `tags`): one of the
+// `CUSTOM_LABELS_VALUE_*` types, shifted into place.
+#define LABEL_VALUE_TYPE_SHIFT 5
+#define LABEL_VALUE_TYPE (0x3 << LABEL_VALUE_TYPE_SHIFT)
+
+// Everything that changes along with a label's value.
+#define LABEL_VALUE_FLAGS (LABEL_VALUE_BY_POINTER | LABEL_VALUE_TYPE)
+
+// Clones of sets whose blocks have this many ancestors get their own
+// copy of every string, so that chains of clones of clones don't keep
+// arbitrarily many old blocks alive.
+#define MAX_SHARE_DEPTH 4
+
+// How many bytes of keys and values to reserve per label
+// when we have no better information.
+#define BYTES_PER_LABEL_HINT 16
+
+// Sets with fewer labels than this are searched linearly.
+#define INDEX_MIN_LABELS 16
+
+// Empty strings all point here, so that their `buf` is
+// never NULL (which would mean "absent" to profilers).
+static const unsigned char empty_buf[1] = {0};
+
 __attribute__((retain))
 __thread custom_labels_labelset_t *custom_labels_current_set = NULL;
 
+__attribute__((retain))
+__thread uint64_t custom_labels_current_id = 0;
+
+__attribute__((retain))
+custom_labels_id_table_t custom_labels_id_table;
+
+// See "Optional: typed values" in custom-labels-v2.md.
+__attribute__((retain))
+uint32_t custom_labels_typed_values_version = 1;
+
+__attribute__((retain))
+custom_labels_stats_table_t custom_labels_stats_table = { CUSTOM_LABELS_STATS_VERSION, {}, NULL };
+
+// Each thread counts into its own record of `custom_labels_stats_table`,
+// which it alone writes, so counting is just a relaxed store. Records
+// are taken from the table (or allocated and prepended to it) under
+// `stats_lock` the first time a thread counts something, and given back
+// when it exits.
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_local custom_labels_thread_stats_t *thread_stats = NULL;
+// Set once the thread has given its record back.
+static thread_local bool stats_detached = false;
+
+#define STATS_N_COUNTERS (sizeof(custom_labels_stats_t) / sizeof(uint64_t))
+
+static uint64_t *stats_counters(custom_labels_stats_t *s) {
+        return (uint64_t *)s;
+}
+
+// Adds the counts of the calling thread to the shared ones and gives
+// its record back. Anything it counts afterwards (e.g., from other
+// thread-local destructors) is added to the shared counts directly.
+static void stats_detach() {
+        custom_labels_thread_stats_t *t = thread_stats;
+        if (!t)
+                return;
+        uint64_t *from = stats_counters(&t->counters);
+        uint64_t *to = stats_counters(&custom_labels_stats_table.shared);
+        pthread_mutex_lock(&stats_lock);
+        for (size_t i = 0; i < STATS_N_COUNTERS; ++i) {
+                __atomic_add_fetch(&to[i], from[i], __ATOMIC_RELAXED);
+                __atomic_store_n(&from[i], 0, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&t->in_use, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&stats_lock);
+        thread_stats = NULL;
+        stats_detached = true;
+}
+
+struct stats_owner {
+        ~stats_owner() {
+                stats_detach();
+        }
+};
+
+static thread_local struct stats_owner stats_owner;
+
+// Gives the calling thread a record to count into, returning it, or
+// NULL if the thread has given its record back or there is none free
+// and allocation fails.
+static custom_labels_thread_stats_t *stats_attach() {
+        if (stats_detached)
+                return NULL;
+        // Make sure the record is given back when the thread exits.
+        (void)&stats_owner;
+        custom_labels_thread_stats_t *t;
+        pthread_mutex_lock(&stats_lock);
+        for (t = custom_labels_stats_table.threads; t; t = t->next) {
+                if (!t->in_use)
+                        break;
+        }
+        if (!t) {
+                t = (custom_labels_thread_stats_t *)calloc(1, sizeof(*t));
+                if (t) {
+                        t->next = custom_labels_stats_table.threads;
+                        // Readers of the list must see the record
+                        // set up before it's linked in.
+                        __atomic_store_n(&custom_labels_stats_table.threads, t, __ATOMIC_RELEASE);
+                }
+        }
+        if (t)
+                t->in_use = 1;
+        pthread_mutex_unlock(&stats_lock);
+        thread_stats = t;
+        return t;
+}
+
+// Adds `n` to the calling thread's counter `field`, or to the
+// shared one if the thread has no record.
+#define STAT_ADD(field, n) do { \
+        custom_labels_thread_stats_t *t_ = thread_stats ? thread_stats : stats_attach(); \
+        if (t_) \
+                __atomic_store_n(&t_->counters.field, t_->counters.field + (n), __ATOMIC_RELAXED); \
+        else \
+                STAT_ADD_SHARED(field, n); \
+} while (0)
+
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+// Adds `n` to the process-wide counter `field`, for
+// things that are counted under a global lock anyway.
+#define STAT_ADD_SHARED(field, n) \
+        __atomic_add_fetch(&custom_labels_stats_table.shared.field, (n), __ATOMIC_RELAXED)
+
+void custom_labels_stats(custom_labels_stats_t *out) {
+        uint64_t *to = stats_counters(out);
+        pthread_mutex_lock(&stats_lock);
+        const uint64_t *shared = stats_counters(&custom_labels_stats_table.shared);
+        for (size_t i = 0; i < STATS_N_COUNTERS; ++i)
+                to[i] = __atomic_load_n(&shared[i], __ATOMIC_RELAXED);
+        for (custom_labels_thread_stats_t *t = custom_labels_stats_table.threads; t; t = t->next) {
+                uint64_t *from = stats_counters(&t->counters);
+                for (size_t i = 0; i < STATS_N_COUNTERS; ++i)
+                        to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&stats_lock);
+}
+
+// Memory that readers on other threads may still be using (see
+// `custom_labels_read_begin`) is retired rather than freed: each thread
+// queues what it retires and frees it once no reader can be using it,
+// or, if `reclaim_max_bytes` is set, once it has queued more than that.
+//
+// Readers count themselves in `readers`, under the parity of the epoch
+// they start in. The epoch only moves on from `e` once every reader that
+// started in `e - 1` is done, so memory retired in epoch `e` is safe to
+// free once the epoch is `e + 2`, or whenever no reader is counted.
+static uint64_t reclaim_epoch = 0;
+static uint64_t readers[2];
+static size_t reclaim_max_bytes = 0;
+
+struct retired {
+        void *p;
+        void (*fn)(void *);
+        size_t size;
+        uint64_t epoch;
+};
+
+// Oldest first, from `head` to `tail`.
+struct quarantine {
+        struct retired *items;
+        size_t head;
+        size_t tail;
+        size_t capacity;
+        size_t bytes;
+
+        ~quarantine();
+};
+
+static thread_local struct quarantine quarantine;
+
+// Set once the thread starts emptying its quarantine on exit, after
+// which other thread-local state (e.g., the pool, and the quarantine
+// itself) may be gone.
+static thread_local bool reclaim_exiting = false;
+
+uint64_t custom_labels_read_begin(void) {
+        for (;;) {
+                uint64_t e = __atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&readers[e & 1], 1, __ATOMIC_SEQ_CST);
+                // If the epoch moved on in the meantime, it may have
+                // done so without waiting for us.
+                if (__atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST) == e)
+                        return e;
+                __atomic_sub_fetch(&readers[e & 1], 1, __ATOMIC_RELEASE);
+        }
+}
+
+void custom_labels_read_end(uint64_t token) {
+        __atomic_sub_fetch(&readers[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+static bool reading() {
+        return __atomic_load_n(&readers[0], __ATOMIC_SEQ_CST) ||
+                __atomic_load_n(&readers[1], __ATOMIC_SEQ_CST);
+}
+
+// Moves the epoch on if no reader from the previous one is left,
+// and returns it.
+static uint64_t epoch_advance() {
+        uint64_t e = __atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST);
+        // Readers from `e - 1` are counted with those that will start
+        // in `e + 1`, none of which can have started yet.
+        if (!__atomic_load_n(&readers[(e + 1) & 1], __ATOMIC_SEQ_CST) &&
+            __atomic_compare_exchange_n(&reclaim_epoch, &e, e + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                ++e;
+        return e;
+}
+
+// Frees retired memory, oldest first, until no more than `target` bytes
+// (or, if `target` is 0, nothing) is left, or the rest may be in use.
+static void reclaim_to(struct quarantine *q, size_t target) {
+        if (q->head == q->tail)
+                return;
+        // Two steps make everything retired so far safe to
+        // free, unless some readers are still going.
+        epoch_advance();
+        uint64_t e = epoch_advance();
+        bool idle = !reading();
+        while (q->head < q->tail && (!target || q->bytes > target)) {
+                struct retired r = q->items[q->head];
+                if (!idle && r.epoch + 2 > e)
+                        break;
+                ++q->head;
+                q->bytes -= r.size;
+                r.fn(r.p);
+        }
+        if (q->head == q->tail)
+                q->head = q->tail = 0;
+}
+
+quarantine::~quarantine() {
+        reclaim_exiting = true;
+        while (head < tail) {
+                reclaim_to(this, 0);
+                if (head < tail)
+                        sched_yield();
+        }
+        free(items);
+        // Other thread-local destructors may still free label sets;
+        // `retire` sees `reclaim_exiting` and doesn't queue them here.
+        items = NULL;
+        capacity = head = tail = bytes = 0;
+}
+
+// Makes room at the end of `q` for one more item. Returns whether it could.
+static bool quarantine_reserve(struct quarantine *q) {
+        if (q->tail < q->capacity)
+                return true;
+        if (q->head && q->head >= q->capacity / 2) {
+                memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(struct retired));
+                q->tail -= q->head;
+                q->head = 0;
+                return true;
+        }
+        size_t capacity = MAX(2 * q->capacity, 64);
+        struct retired *items = (struct retired *)realloc(q->items, capacity * sizeof(struct retired));
+        if (!items)
+                return false;
+        STAT_INC(allocations);
+        STAT_ADD(bytes_allocated, capacity * sizeof(struct retired));
+        q->items = items;
+        q->capacity = capacity;
+        return true;
+}
+
+// Frees `p`, which takes up `size` bytes, by calling `fn` on it once no
+// reader can be using it. Whatever readers start from must no longer
+// lead to it.
+static void retire(void *p, size_t size, void (*fn)(void *)) {
+        // Readers that aren't counted yet will see that it's unreachable.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        size_t max_bytes = __atomic_load_n(&reclaim_max_bytes, __ATOMIC_RELAXED);
+        if (!max_bytes && !reading()) {
+                fn(p);
+                return;
+        }
+        struct quarantine *q = &quarantine;
+        if (reclaim_exiting || !quarantine_reserve(q)) {
+                // The quarantine is gone, or there's no room to remember
+                // it, so wait for the readers to be done with it instead.
+                uint64_t e = __atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST);
+                while (reading() && epoch_advance() < e + 2)
+                        sched_yield();
+                fn(p);
+                return;
+        }
+        q->items[q->tail++] = (struct retired) { p, fn, size, __atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST) };
+        q->bytes += size;
+        if (q->bytes > max_bytes)
+                reclaim_to(q, max_bytes / 2);
+}
+
+// Whether memory that a set pointed to until just now may still be read,
+// so that it must be retired rather than reused: by readers in the
+// process, or by those outside it if memory is held on to for them.
+// Readers are counted before they look at a set, so either they're
+// seen here or they see whatever was stored before this was called.
+static bool may_be_read() {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return __atomic_load_n(&reclaim_max_bytes, __ATOMIC_RELAXED) || reading();
+}
+
+void custom_labels_reclaim_configure(size_t max_bytes) {
+        __atomic_store_n(&reclaim_max_bytes, max_bytes, __ATOMIC_RELAXED);
+}
+
+void custom_labels_reclaim(void) {
+        reclaim_to(&quarantine, 0);
+}
+
+// `unpublished` of a set that `custom_labels_replace` has just
+// moved off the current set; otherwise it's 1 + the epoch in which
+// that was noticed, until no reader from then is left.
+#define UNPUBLISHED_NOW UINT64_MAX
+
+static bool still_published(custom_labels_labelset_t *ls) {
+        // Readers that aren't counted yet will see that it's not current.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // Readers outside the process may have it for as long as
+        // memory is held on to for them.
+        if (__atomic_load_n(&reclaim_max_bytes, __ATOMIC_RELAXED))
+                return true;
+        if (ls->unpublished == UNPUBLISHED_NOW && reading()) {
+                ls->unpublished = __atomic_load_n(&reclaim_epoch, __ATOMIC_SEQ_CST) + 1;
+                return true;
+        }
+        // As in `reclaim_to`, two steps leave no reader that started
+        // while it was current.
+        if (ls->unpublished != UNPUBLISHED_NOW && reading() && epoch_advance() < ls->unpublished + 1)
+                return true;
+        ls->unpublished = 0;
+        return false;
+}
+
+// Whether readers may be looking at `ls`, so that changes to it must
+// be careful: it is the current set, or it was until recently, and
+// a reader on another thread may have picked it up then.
+static bool published(custom_labels_labelset_t *ls) {
+        return ls == custom_labels_current_set || (ls->unpublished && still_published(ls));
+}
+
 static bool eq(custom_labels_string_t l, custom_labels_string_t r) {
         return l.len == r.len &&
                 !memcmp(l.buf, r.buf, l.len);
 }
 
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+// FNV-1a
+static uint64_t hash_extend(uint64_t h, const unsigned char *buf, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+                h ^= buf[i];
+                h *= 0x100000001b3ULL;
+        }
+        return h;
+}
+
+static uint64_t hash_bytes(custom_labels_string_t s) {
+        return hash_extend(HASH_INIT, s.buf, s.len);
+}
+
+// Interned keys live in a process-wide hash table, protected by `keys_lock`.
+// They are never freed, so labels can point at them for as long as they like.
+struct _custom_labels_key {
+        custom_labels_string_t str;
+        uint64_t hash;
+        struct _custom_labels_key *next;
+};
+
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct _custom_labels_key **keys_buckets = NULL;
+static size_t keys_n_buckets = 0;
+static size_t keys_count = 0;
+
+// Must be called with `keys_lock` held.
+static void keys_grow() {
+        size_t n = MAX(2 * keys_n_buckets, 64);
+        struct _custom_labels_key **buckets = (struct _custom_labels_key **)calloc(n, sizeof(struct _custom_labels_key *));
+        if (!buckets)
+                return; // Keep using the old table; it just gets slower.
+        for (size_t i = 0; i < keys_n_buckets; ++i) {
+                struct _custom_labels_key *k = keys_buckets[i];
+                while (k) {
+                        struct _custom_labels_key *next = k->next;
+                        k->next = buckets[k->hash & (n - 1)];
+                        buckets[k->hash & (n - 1)] = k;
+                        k = next;
+                }
+        }
+        free(keys_buckets);
+        keys_buckets = buckets;
+        keys_n_buckets = n;
+}
+
+custom_labels_key_t custom_labels_key_intern(custom_labels_string_t key) {
+        assert(key.buf);
+        uint64_t hash = hash_bytes(key);
+        struct _custom_labels_key *k = NULL;
+
+        pthread_mutex_lock(&keys_lock);
+        if (keys_count >= keys_n_buckets)
+                keys_grow();
+        if (!keys_n_buckets)
+                goto out;
+        for (k = keys_buckets[hash & (keys_n_buckets - 1)]; k; k = k->next) {
+                if (k->hash == hash && eq(k->str, key))
+                        goto out;
+        }
+        k = (struct _custom_labels_key *)malloc(sizeof(struct _custom_labels_key) + key.len);
+        if (!k)
+                goto out;
+        if (key.len) {
+                memcpy(k + 1, key.buf, key.len);
+                k->str = (custom_labels_string_t) {key.len, (const unsigned char *)(k + 1)};
+        } else {
+                k->str = (custom_labels_string_t) {0, empty_buf};
+        }
+        k->hash = hash;
+        k->next = keys_buckets[hash & (keys_n_buckets - 1)];
+        keys_buckets[hash & (keys_n_buckets - 1)] = k;
+        ++keys_count;
+        STAT_ADD_SHARED(keys_interned, 1);
+out:
+        pthread_mutex_unlock(&keys_lock);
+        return k;
+}
+
+custom_labels_string_t custom_labels_key_string(custom_labels_key_t key) {
+        return key->str;
+}
+
+// The `CUSTOM_LABELS_VALUE_*` type of the label at `i` in `storage`,
+// whose flags are `tags`.
+static unsigned value_type(const unsigned char *tags, size_t i) {
+        return (tags[i] & LABEL_VALUE_TYPE) >> LABEL_VALUE_TYPE_SHIFT;
+}
+
+// Room for any 64-bit integer in decimal.
+#define DECIMAL_MAX 20
+
+// Returns `value`, the value of the label at `i` in `storage`, as text:
+// as it is, unless it is typed, in which case it is written in decimal
+// into `buf`. This is async-signal-safe.
+static custom_labels_string_t value_text(const unsigned char *tags, size_t i, custom_labels_string_t value, unsigned char buf[DECIMAL_MAX]) {
+        unsigned type = tags ? value_type(tags, i) : CUSTOM_LABELS_VALUE_BYTES;
+        if (type == CUSTOM_LABELS_VALUE_BYTES || value.len != 8)
+                return value;
+        uint64_t bits = 0;
+        for (int j = 0; j < 8; ++j)
+                bits |= (uint64_t)value.buf[j] << 8 * j;
+        bool negative = type == CUSTOM_LABELS_VALUE_I64 && (int64_t)bits < 0;
+        if (negative)
+                bits = -bits;
+        unsigned char digits[DECIMAL_MAX];
+        size_t n = 0;
+        do {
+                digits[n++] = '0' + bits % 10;
+                bits /= 10;
+        } while (bits);
+        size_t len = 0;
+        if (negative)
+                buf[len++] = '-';
+        while (n)
+                buf[len++] = digits[--n];
+        return (custom_labels_string_t) { len, buf };
+}
+
 #include <stdio.h>
 
 int custom_labels_debug_string(const custom_labels_labelset_t *ls, custom_labels_string_t *out) {
+        unsigned char decimal[DECIMAL_MAX];
         out->len = 2; // for '{' and '}'
         for (size_t i = 0; i < ls->count; ++i) {
                 out->len += ls->storage[i].key.len;
                 out->len += 2; // for ': '
-                out->len += ls->storage[i].value.len;
+                out->len += value_text(ls->tags, i, ls->storage[i].value, decimal).len;
                 if (i > 0) {
                         out->len += 2; // for ', '
                 }
@@ -63,310 +635,1616 @@ int custom_labels_debug_string(const custom_labels_labelset_t *ls, custom_labels
                 *s++ = ':';
                 *s++ = ' ';
 
-                memcpy(s, lbl->value.buf, lbl->value.len);
-                s += lbl->value.len;
+                custom_labels_string_t value = value_text(ls->tags, i, lbl->value, decimal);
+                memcpy(s, value.buf, value.len);
+                s += value.len;
         }
         *s++ = '}';
 
-        assert((s - out->buf) == (ssize_t) out->len);
+        assert((s - out->buf) == (ssize_t) out->len);
+
+        return 0;
+}
+
+// The fingerprints array is padded so that it can always be
+// scanned a whole vector at a time.
+#define FP_ROUND(capacity) (((capacity) + 31) & ~(size_t)31)
+
+// The number of bytes taken up by a block with room for
+// `capacity` labels and `size` bytes of keys and values.
+#define BLOCK_ALLOC_SIZE(capacity, size) \
+        (sizeof(struct block) + (capacity) * (sizeof(custom_labels_label_t) + 1) + FP_ROUND(capacity) + (size))
+
+// Sets up an empty block in `mem`, which must be
+// at least `BLOCK_ALLOC_SIZE(capacity, size)` bytes long.
+static struct block *block_init(void *mem, size_t capacity, size_t size, bool borrowed) {
+        struct block *b = (struct block *)mem;
+        b->flags = (unsigned char *)((custom_labels_label_t *)(b + 1) + capacity);
+        b->fingerprints = b->flags + capacity;
+        memset(b->fingerprints, 0, FP_ROUND(capacity));
+        b->bytes = b->fingerprints + FP_ROUND(capacity);
+        b->size = size;
+        b->used = 0;
+        b->garbage = 0;
+        b->borrowed = borrowed;
+        b->refcount = 1;
+        b->parent = NULL;
+        b->depth = 0;
+        return b;
+}
+
+static struct block *block_new(size_t capacity, size_t size) {
+        void *mem = malloc(BLOCK_ALLOC_SIZE(capacity, size));
+        if (!mem)
+                return NULL;
+        STAT_INC(allocations);
+        STAT_ADD(bytes_allocated, BLOCK_ALLOC_SIZE(capacity, size));
+        return block_init(mem, capacity, size, false);
+}
+
+// Makes `b` refer to the bytes of `parent` (and its ancestors).
+static void block_set_parent(struct block *b, struct block *parent) {
+        if (!parent)
+                return;
+        __atomic_add_fetch(&parent->refcount, 1, __ATOMIC_RELAXED);
+        b->parent = parent;
+        b->depth = parent->depth + 1;
+}
+
+// Drops a reference to `b`, freeing it (and any of its ancestors
+// that are no longer referenced) if it was the last one.
+static void block_unref(struct block *b) {
+        while (b && !__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL)) {
+                struct block *parent = b->parent;
+                if (!b->borrowed)
+                        free(b);
+                b = parent;
+        }
+}
+
+// Whether `b` is referred to by nothing but its label set,
+// so that its bytes may be overwritten.
+static bool block_exclusive(struct block *b) {
+        return __atomic_load_n(&b->refcount, __ATOMIC_ACQUIRE) == 1;
+}
+
+static custom_labels_label_t *block_labels(struct block *b) {
+        return (custom_labels_label_t *)(b + 1);
+}
+
+// Whether `buf` points into the bytes area of `b`.
+static bool block_owns(const struct block *b, const unsigned char *buf) {
+        return b && buf >= b->bytes && buf < b->bytes + b->size;
+}
+
+// Copies `s` into the free space of `b`, which the caller
+// must have reserved.
+static custom_labels_string_t block_copy_in(struct block *b, custom_labels_string_t s) {
+        if (!s.len)
+                return (custom_labels_string_t) {0, empty_buf};
+        unsigned char *buf = b->bytes + b->used;
+        memcpy(buf, s.buf, s.len);
+        b->used += s.len;
+        return (custom_labels_string_t) {s.len, buf};
+}
+
+// Marks the bytes of `s` as no longer referenced.
+static void block_release(struct block *b, custom_labels_string_t s) {
+        if (block_owns(b, s.buf))
+                b->garbage += s.len;
+}
+
+// Releases the key of a label that had the given flags.
+static void release_key(struct block *b, custom_labels_string_t key, unsigned char flags) {
+        if (flags & LABEL_KEY_OWNED)
+                free((void *)key.buf);
+        else
+                block_release(b, key);
+}
+
+// Releases the value of a label that had the given flags.
+static void release_value(struct block *b, custom_labels_string_t value, unsigned char flags) {
+        if (flags & LABEL_VALUE_OWNED)
+                free((void *)value.buf);
+        else
+                block_release(b, value);
+}
+
+// Like `release_key` and `release_value`, for labels that readers on
+// other threads may have seen: strings are retired rather than freed.
+static void careful_release_key(struct block *b, custom_labels_string_t key, unsigned char flags) {
+        if (flags & LABEL_KEY_OWNED)
+                retire((void *)key.buf, key.len, free);
+        else
+                block_release(b, key);
+}
+
+static void careful_release_value(struct block *b, custom_labels_string_t value, unsigned char flags) {
+        if (flags & LABEL_VALUE_OWNED)
+                retire((void *)value.buf, value.len, free);
+        else
+                block_release(b, value);
+}
+
+static void block_unref_retired(void *b) {
+        block_unref((struct block *)b);
+}
+
+// Like `block_unref`, for a block that readers on other threads may
+// have seen. The reference is dropped only once they're done: if it
+// isn't the last one, whoever holds the last may free the block
+// directly, without waiting for the readers of this set.
+static void careful_block_unref(struct block *b) {
+        // Borrowed blocks aren't freed, and their memory may be reused
+        // as soon as this returns, so only their parents can wait.
+        while (b && b->borrowed) {
+                if (__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL))
+                        return;
+                b = b->parent;
+        }
+        if (b) {
+                size_t capacity = (b->flags - (unsigned char *)block_labels(b)) / sizeof(custom_labels_label_t);
+                retire(b, BLOCK_ALLOC_SIZE(capacity, b->size), block_unref_retired);
+        }
+}
+
+// The number of bytes that have to be reserved to store a label
+// with the given flags.
+static size_t label_bytes(custom_labels_string_t key, custom_labels_string_t value, unsigned char flags) {
+        return (flags & LABEL_KEY_BY_POINTER ? 0 : key.len) +
+                (flags & LABEL_VALUE_BY_POINTER ? 0 : value.len);
+}
+
+// Makes a label out of `key` and `value`, copying whichever of them
+// `flags` doesn't say to store by pointer into `b`, which must have
+// room reserved for them.
+static custom_labels_label_t label_copy_in(struct block *b, custom_labels_string_t key, custom_labels_string_t value, unsigned char flags) {
+        return (custom_labels_label_t) {
+                flags & LABEL_KEY_BY_POINTER ? key : block_copy_in(b, key),
+                flags & LABEL_VALUE_BY_POINTER ? value : block_copy_in(b, value),
+        };
+}
+
+// Moves `ls` to a fresh block with room for `capacity` labels
+// and `size` bytes, dropping any garbage along the way.
+//
+// This is safe to do on the current set: the new storage is completely
+// set up before it is published. The old block is returned in `*old_out`
+// rather than released, since strings the caller is about to copy in
+// may still point into it; the caller must release it when done.
+//
+// Only strings in the set's own block are moved; any that point into
+// the bytes of its ancestors keep doing so.
+static int relocate(custom_labels_labelset_t *ls, size_t capacity, size_t size, struct block **old_out) {
+        struct block *b = block_new(capacity, size);
+        if (!b)
+                return errno;
+        STAT_INC(reallocations);
+        PROBE(grow, ls, ls->capacity, capacity, size);
+        if (ls->block)
+                block_set_parent(b, ls->block->parent);
+        custom_labels_label_t *storage = block_labels(b);
+        for (size_t i = 0; i < ls->count; ++i) {
+                custom_labels_label_t lbl = ls->storage[i];
+                if (block_owns(ls->block, lbl.key.buf))
+                        lbl.key = block_copy_in(b, lbl.key);
+                if (block_owns(ls->block, lbl.value.buf))
+                        lbl.value = block_copy_in(b, lbl.value);
+                storage[i] = lbl;
+                b->flags[i] = ls->block->flags[i];
+                b->fingerprints[i] = ls->block->fingerprints[i];
+        }
+        *old_out = ls->block;
+        // The new storage has to be ready before profilers can see it,
+        // and it has to be seen before the caller frees the old one.
+        // Until `storage` is updated, the old and new tags agree.
+        __atomic_store_n(&ls->tags, b->flags, __ATOMIC_RELEASE);
+        __atomic_store_n(&ls->storage, storage, __ATOMIC_RELEASE);
+        BARRIER;
+        ls->capacity = capacity;
+        ls->block = b;
+        return 0;
+}
+
+// Makes sure `ls` has room for `n_labels` more labels and `n_bytes`
+// more bytes of keys and values, relocating it if necessary.
+// See `relocate` for the meaning of `*old_out`, which is set to NULL
+// if the set did not move.
+static int reserve(custom_labels_labelset_t *ls, size_t n_labels, size_t n_bytes, struct block **old_out) {
+        *old_out = NULL;
+        struct block *b = ls->block;
+        size_t size = b ? b->size : 0;
+        size_t used = b ? b->used : 0;
+        if (ls->count + n_labels <= ls->capacity && used + n_bytes <= size)
+                return 0;
+
+        size_t capacity = ls->capacity;
+        while (capacity < ls->count + n_labels)
+                capacity = MAX(2 * capacity, 1);
+        // Only grow the bytes area if compacting it wouldn't
+        // free up at least half of it; otherwise we'd end up
+        // relocating over and over as it fills back up.
+        size_t wanted = used - (b ? b->garbage : 0) + n_bytes;
+        if (2 * wanted > size)
+                size = MAX(2 * size, wanted);
+        return relocate(ls, capacity, size, old_out);
+}
+
+// Interned label sets (see `custom_labels_intern_set`) are kept in the
+// exported `custom_labels_id_table`, which profilers read, and in a
+// hash table from their contents to their IDs, protected by `sets_lock`.
+// Both only ever grow, and the labels of an entry never change or move.
+struct interned_set {
+        uint64_t hash;
+        uint64_t id;
+        struct interned_set *next;
+};
+
+static pthread_mutex_t sets_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct interned_set **sets_buckets = NULL;
+static size_t sets_n_buckets = 0;
+
+static const custom_labels_id_entry_t *id_entry(uint64_t id) {
+        uint64_t i = id - 1;
+        return &custom_labels_id_table.chunks[i / CUSTOM_LABELS_ID_CHUNK_SIZE][i % CUSTOM_LABELS_ID_CHUNK_SIZE];
+}
+
+static void sets_grow() {
+        size_t n_buckets = sets_n_buckets ? 2 * sets_n_buckets : 64;
+        struct interned_set **buckets = (struct interned_set **)calloc(n_buckets, sizeof(*buckets));
+        if (!buckets)
+                return;
+        for (size_t i = 0; i < sets_n_buckets; ++i) {
+                for (struct interned_set *s = sets_buckets[i], *next; s; s = next) {
+                        next = s->next;
+                        s->next = buckets[s->hash & (n_buckets - 1)];
+                        buckets[s->hash & (n_buckets - 1)] = s;
+                }
+        }
+        free(sets_buckets);
+        sets_buckets = buckets;
+        sets_n_buckets = n_buckets;
+}
+
+static int compare_labels_by_key(const void *l, const void *r) {
+        custom_labels_string_t a = (*(const custom_labels_label_t *const *)l)->key;
+        custom_labels_string_t b = (*(const custom_labels_label_t *const *)r)->key;
+        int c = memcmp(a.buf, b.buf, a.len < b.len ? a.len : b.len);
+        if (c)
+                return c;
+        return a.len < b.len ? -1 : a.len > b.len;
+}
+
+// Whether the entry for `id` has the labels in `sorted`.
+static bool id_entry_eq(uint64_t id, const custom_labels_label_t **sorted, size_t n) {
+        const custom_labels_id_entry_t *e = id_entry(id);
+        if (e->count != n)
+                return false;
+        for (size_t i = 0; i < n; ++i) {
+                if (!eq(e->labels[i].key, sorted[i]->key) || !eq(e->labels[i].value, sorted[i]->value))
+                        return false;
+        }
+        return true;
+}
+
+// Appends an entry with a copy of the labels in `sorted` to the
+// ID table, returning its ID, or 0 on failure. `sets_lock` must be held.
+static uint64_t id_table_append(const custom_labels_label_t **sorted, size_t n) {
+        uint64_t i = custom_labels_id_table.count;
+        size_t chunk = i / CUSTOM_LABELS_ID_CHUNK_SIZE;
+        if (chunk >= CUSTOM_LABELS_ID_MAX_CHUNKS) {
+                errno = ENOSPC;
+                return 0;
+        }
+        if (!custom_labels_id_table.chunks[chunk]) {
+                custom_labels_id_entry_t *entries = (custom_labels_id_entry_t *)calloc(CUSTOM_LABELS_ID_CHUNK_SIZE, sizeof(*entries));
+                if (!entries)
+                        return 0;
+                __atomic_store_n(&custom_labels_id_table.chunks[chunk], entries, __ATOMIC_RELEASE);
+        }
+        size_t size = n * sizeof(custom_labels_label_t);
+        for (size_t j = 0; j < n; ++j)
+                size += sorted[j]->key.len + sorted[j]->value.len;
+        custom_labels_label_t *labels = (custom_labels_label_t *)malloc(size ? size : 1);
+        if (!labels)
+                return 0;
+        unsigned char *bytes = (unsigned char *)(labels + n);
+        for (size_t j = 0; j < n; ++j) {
+                custom_labels_string_t strs[2] = { sorted[j]->key, sorted[j]->value };
+                for (int k = 0; k < 2; ++k) {
+                        memcpy(bytes, strs[k].buf, strs[k].len);
+                        strs[k].buf = strs[k].len ? bytes : empty_buf;
+                        bytes += strs[k].len;
+                }
+                labels[j] = (custom_labels_label_t) { strs[0], strs[1] };
+        }
+        custom_labels_id_entry_t *e = &custom_labels_id_table.chunks[chunk][i % CUSTOM_LABELS_ID_CHUNK_SIZE];
+        e->labels = labels;
+        e->count = n;
+        // Profilers must see the entry before the count that covers it.
+        __atomic_store_n(&custom_labels_id_table.count, i + 1, __ATOMIC_RELEASE);
+        STAT_ADD_SHARED(sets_interned, 1);
+        return i + 1;
+}
+
+int custom_labels_intern_set(custom_labels_labelset_t *ls, uint64_t *id_out) {
+        if (!ls->id) {
+                // Entries hold typed values as text, so next to the
+                // pointers there's room for the labels that have them.
+                size_t n_alloc = ls->count ? ls->count : 1;
+                const custom_labels_label_t **sorted = (const custom_labels_label_t **)malloc(n_alloc * (sizeof(*sorted) + sizeof(custom_labels_label_t) + DECIMAL_MAX));
+                if (!sorted)
+                        return errno;
+                custom_labels_label_t *texts = (custom_labels_label_t *)(sorted + n_alloc);
+                unsigned char *decimals = (unsigned char *)(texts + n_alloc);
+                size_t n = 0;
+                for (size_t i = 0; i < ls->count; ++i) {
+                        if (!ls->storage[i].key.buf)
+                                continue;
+                        texts[n] = ls->storage[i];
+                        texts[n].value = value_text(ls->tags, i, texts[n].value, decimals + n * DECIMAL_MAX);
+                        sorted[n] = &texts[n];
+                        ++n;
+                }
+                qsort(sorted, n, sizeof(*sorted), compare_labels_by_key);
+                uint64_t hash = HASH_INIT;
+                for (size_t i = 0; i < n; ++i) {
+                        size_t lens[2] = { sorted[i]->key.len, sorted[i]->value.len };
+                        hash = hash_extend(hash, (const unsigned char *)lens, sizeof(lens));
+                        hash = hash_extend(hash, sorted[i]->key.buf, sorted[i]->key.len);
+                        hash = hash_extend(hash, sorted[i]->value.buf, sorted[i]->value.len);
+                }
+
+                pthread_mutex_lock(&sets_lock);
+                uint64_t id = 0;
+                if (sets_n_buckets) {
+                        for (struct interned_set *s = sets_buckets[hash & (sets_n_buckets - 1)]; s && !id; s = s->next) {
+                                if (s->hash == hash && id_entry_eq(s->id, sorted, n))
+                                        id = s->id;
+                        }
+                }
+                int error = 0;
+                if (!id) {
+                        if (custom_labels_id_table.count >= sets_n_buckets)
+                                sets_grow();
+                        struct interned_set *s = sets_n_buckets ? (struct interned_set *)malloc(sizeof(*s)) : NULL;
+                        if (s)
+                                id = id_table_append(sorted, n);
+                        if (!id) {
+                                error = errno;
+                                free(s);
+                        } else {
+                                s->hash = hash;
+                                s->id = id;
+                                s->next = sets_buckets[hash & (sets_n_buckets - 1)];
+                                sets_buckets[hash & (sets_n_buckets - 1)] = s;
+                        }
+                }
+                pthread_mutex_unlock(&sets_lock);
+                free(sorted);
+                if (error)
+                        return error;
+                // Other threads may be reading a frozen set, so it
+                // only has an ID if it was interned before it was frozen.
+                if (frozen(ls)) {
+                        if (id_out)
+                                *id_out = id;
+                        return 0;
+                }
+                ls->id = id;
+                if (ls == custom_labels_current_set) {
+                        // The entry is complete, so profilers may start using the ID.
+                        __atomic_store_n(&custom_labels_current_id, id, __ATOMIC_RELEASE);
+                }
+        }
+        if (id_out)
+                *id_out = ls->id;
+        return 0;
+}
+
+uint64_t custom_labels_set_id(const custom_labels_labelset_t *ls) {
+        return ls->id;
+}
+
+// Called before `ls` is changed, since its contents
+// will no longer match its ID.
+static void forget_id(custom_labels_labelset_t *ls) {
+        if (!ls->id)
+                return;
+        if (ls == custom_labels_current_set) {
+                __atomic_store_n(&custom_labels_current_id, 0, __ATOMIC_RELAXED);
+                // Profilers have to stop using the ID before
+                // they can see any of the changes.
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+        }
+        ls->id = 0;
+}
+
+// Each set counts its changes through a range of GENERATION_STRIDE
+// generations that no other set has had, and takes a fresh range when it
+// runs out. Ranges are carved out of a 64-bit counter that doesn't wrap
+// in practice (at a billion generations a second, it lasts for centuries),
+// and handed out to threads in batches of GENERATION_BATCH, so that
+// creating a set doesn't contend on it.
+#define GENERATION_STRIDE 256
+#define GENERATION_BATCH 1024
+
+static uint64_t generation_ranges = 0;
+static thread_local uint64_t generation_next = 0, generation_end = 0;
+
+// Returns the start of a range no set has had, which is even.
+static uint64_t new_generation() {
+        if (generation_next == generation_end) {
+                generation_next = __atomic_fetch_add(&generation_ranges, GENERATION_STRIDE * GENERATION_BATCH, __ATOMIC_RELAXED);
+                generation_end = generation_next + GENERATION_STRIDE * GENERATION_BATCH;
+        }
+        uint64_t g = generation_next;
+        generation_next += GENERATION_STRIDE;
+        return g;
+}
+
+// Returns the generation that counts a change to `ls`. Only the even
+// step at the end of a change can reach the end of the range, since the
+// stride is even, so moving on to a new range keeps the generation even.
+static uint64_t generation_step(const custom_labels_labelset_t *ls) {
+        uint64_t g = ls->generation + 1;
+        if (!(g & (GENERATION_STRIDE - 1)))
+                g = new_generation();
+        return g;
+}
+
+// Every change to the labels of `ls` is bracketed by these, so that
+// its generation is odd while the change is in progress. Profilers
+// don't cache what they read from a set with an odd generation, and
+// readers on other threads read it before and after the labels, like a
+// seqlock: the odd generation is visible before any of the change is,
+// and all of the change before the even one.
+static void mutation_begin(custom_labels_labelset_t *ls) {
+        forget_id(ls);
+        __atomic_store_n(&ls->generation, generation_step(ls), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void mutation_end(custom_labels_labelset_t *ls) {
+        __atomic_store_n(&ls->generation, generation_step(ls), __ATOMIC_RELEASE);
+}
+
+// Large sets keep an open-addressing hash table from keys to their
+// positions in `storage`, so that looking a label up doesn't take time
+// proportional to the size of the set. It's private to the library,
+// so profilers never see it, and is built the first time it's needed.
+//
+// The index is only ever a cache: if it can't be allocated or grown,
+// it's dropped and the set goes back to being searched linearly.
+struct index {
+        size_t mask;
+        // followed by `mask + 1` slots, each of which is either 0 (empty)
+        // or one more than the position of a label, found by linear probing
+        // from the hash of its key.
+};
+
+static uint32_t *index_slots(struct index *ix) {
+        return (uint32_t *)(ix + 1);
+}
+
+static size_t index_home(const custom_labels_labelset_t *ls, size_t pos) {
+        return hash_bytes(ls->storage[pos].key) & ls->index->mask;
+}
+
+static void index_insert(custom_labels_labelset_t *ls, size_t pos) {
+        uint32_t *slots = index_slots(ls->index);
+        size_t i = index_home(ls, pos);
+        while (slots[i])
+                i = (i + 1) & ls->index->mask;
+        slots[i] = pos + 1;
+}
+
+static void index_drop(custom_labels_labelset_t *ls) {
+        free(ls->index);
+        ls->index = NULL;
+}
+
+// (Re)builds the index of `ls` with room for `n` labels,
+// returning whether it succeeded.
+static bool index_build(custom_labels_labelset_t *ls, size_t n) {
+        size_t n_slots = 2 * INDEX_MIN_LABELS;
+        while (n_slots < 2 * n)
+                n_slots *= 2;
+        struct index *ix = (struct index *)calloc(1, sizeof(struct index) + n_slots * sizeof(uint32_t));
+        free(ls->index);
+        ls->index = ix;
+        if (!ix)
+                return false;
+        STAT_INC(allocations);
+        STAT_ADD(bytes_allocated, sizeof(struct index) + n_slots * sizeof(uint32_t));
+        ix->mask = n_slots - 1;
+        for (size_t i = 0; i < ls->count; ++i)
+                index_insert(ls, i);
+        return true;
+}
+
+// Returns the slot holding the label at `pos`.
+static size_t index_find_slot(custom_labels_labelset_t *ls, size_t pos) {
+        uint32_t *slots = index_slots(ls->index);
+        size_t i = index_home(ls, pos);
+        while (slots[i] != pos + 1) {
+                assert(slots[i]);
+                i = (i + 1) & ls->index->mask;
+        }
+        return i;
+}
+
+// Records that the label at `pos`, which must be the last one,
+// has been added to `ls`.
+static void index_add(custom_labels_labelset_t *ls, size_t pos) {
+        if (!ls->index)
+                return;
+        if (2 * ls->count > ls->index->mask + 1) {
+                if (!index_build(ls, 2 * ls->count))
+                        return;
+        } else {
+                index_insert(ls, pos);
+        }
+}
+
+// Records that the label at `pos` is about to be removed from `ls`,
+// and the last label moved into its place.
+// Must be called while both labels are still intact.
+static void index_swap_remove(custom_labels_labelset_t *ls, size_t pos) {
+        if (!ls->index)
+                return;
+        uint32_t *slots = index_slots(ls->index);
+        size_t mask = ls->index->mask;
+        size_t last = ls->count - 1;
+        // Empty the slot, and shift back any later labels in the
+        // same run that wouldn't otherwise be found any more.
+        size_t i = index_find_slot(ls, pos);
+        for (size_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+                size_t home = index_home(ls, slots[j] - 1);
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                        slots[i] = slots[j];
+                        i = j;
+                }
+        }
+        slots[i] = 0;
+        if (pos != last)
+                slots[index_find_slot(ls, last)] = pos + 1;
+}
+
+// Looks `key`, whose hash is `hash`, up in the index of `ls`.
+static custom_labels_label_t *index_get(custom_labels_labelset_t *ls, custom_labels_string_t key, uint64_t hash) {
+        uint32_t *slots = index_slots(ls->index);
+        for (size_t i = hash & ls->index->mask; slots[i]; i = (i + 1) & ls->index->mask) {
+                custom_labels_label_t *lbl = &ls->storage[slots[i] - 1];
+                if (lbl->key.buf && (lbl->key.buf == key.buf || eq(lbl->key, key)))
+                        return lbl;
+        }
+        return NULL;
+}
+
+// Whether `ls` should be, and can be, searched with its index.
+static bool use_index(custom_labels_labelset_t *ls) {
+        if (ls->count < INDEX_MIN_LABELS)
+                return false;
+        // Frozen sets may be read by several threads at once, so their
+        // index is built when they're frozen or not at all.
+        return ls->index || (!frozen(ls) && index_build(ls, ls->count));
+}
+
+static unsigned char fingerprint(uint64_t hash) {
+        return hash >> 56;
+}
+
+// `fp_match` compares the FP_LANES fingerprints at `fps` with `fp`,
+// returning a mask with FP_LANE_BITS bits for each of them, the lowest
+// of which is set if they're equal.
+#if defined(__AVX2__)
+#define FP_LANES 32
+#define FP_LANE_BITS 1
+static uint64_t fp_match(const unsigned char *fps, unsigned char fp) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)fps);
+        return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(fp)));
+}
+#elif defined(__SSE2__)
+#define FP_LANES 16
+#define FP_LANE_BITS 1
+static uint64_t fp_match(const unsigned char *fps, unsigned char fp) {
+        __m128i v = _mm_loadu_si128((const __m128i *)fps);
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(fp)));
+}
+#elif defined(__ARM_NEON)
+#define FP_LANES 16
+#define FP_LANE_BITS 4
+static uint64_t fp_match(const unsigned char *fps, unsigned char fp) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(fps), vdupq_n_u8(fp));
+        // NEON has no movemask; narrowing each 16-bit lane by 4 bits
+        // packs the comparison into a nibble per byte.
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x1111111111111111ULL;
+}
+#else
+#define FP_LANES 8
+#define FP_LANE_BITS 1
+static uint64_t fp_match(const unsigned char *fps, unsigned char fp) {
+        uint64_t mask = 0;
+        for (int i = 0; i < FP_LANES; ++i)
+                mask |= (uint64_t)(fps[i] == fp) << i;
+        return mask;
+}
+#endif
+
+// Finds the label for `key`, whose hash is `hash`, by scanning the
+// fingerprints of `ls`, so that the key bytes of labels are only
+// looked at when their fingerprint matches.
+static custom_labels_label_t *scan(custom_labels_labelset_t *ls, custom_labels_string_t key, uint64_t hash) {
+        unsigned char fp = fingerprint(hash);
+        for (size_t i = 0; i < ls->count; i += FP_LANES) {
+                uint64_t mask = fp_match(ls->block->fingerprints + i, fp);
+                // Lanes past the end hold stale fingerprints.
+                if (ls->count - i < FP_LANES)
+                        mask &= ((uint64_t)1 << (ls->count - i) * FP_LANE_BITS) - 1;
+                for (; mask; mask &= mask - 1) {
+                        custom_labels_label_t *lbl = &ls->storage[i + __builtin_ctzll(mask) / FP_LANE_BITS];
+                        if (lbl->key.buf && (lbl->key.buf == key.buf || eq(lbl->key, key)))
+                                return lbl;
+                }
+        }
+        return NULL;
+}
+
+static custom_labels_label_t *get_mut(custom_labels_labelset_t *ls, custom_labels_string_t key) {
+        uint64_t hash = hash_bytes(key);
+        if (use_index(ls))
+                return index_get(ls, key, hash);
+        return scan(ls, key, hash);
+}
+
+static custom_labels_label_t *get_mut_k(custom_labels_labelset_t *ls, custom_labels_key_t key) {
+        if (use_index(ls))
+                return index_get(ls, key->str, key->hash);
+        return scan(ls, key->str, key->hash);
+}
+
+const custom_labels_label_t *custom_labels_get(custom_labels_labelset_t *ls, custom_labels_string_t key) {
+        return get_mut(ls, key);
+}
+
+const custom_labels_label_t *custom_labels_get_k(custom_labels_labelset_t *ls, custom_labels_key_t key) {
+        return get_mut_k(ls, key);
+}
+
+// `push` pushes a new element onto the current set's vector of labels.
+// `key` must not be the same as any existing label's key, which must
+// be checked by the caller.
+//
+// `flags` are the label flags for the new label; strings it says
+// to store by pointer are not copied in.
+static int careful_push(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, unsigned char flags) {
+        struct block *old_block;
+        // Moving the set doesn't change its labels, so it
+        // doesn't need to be part of the mutation.
+        int error = reserve(ls, 1, label_bytes(key, value, flags), &old_block);
+        if (error)
+                return error;
+        STAT_INC(careful_ops);
+        mutation_begin(ls);
+        ls->storage[ls->count] = label_copy_in(ls->block, key, value, flags);
+        ls->block->flags[ls->count] = flags;
+        ls->block->fingerprints[ls->count] = fingerprint(hash_bytes(key));
+        careful_block_unref(old_block);
+        // Make sure the new item is written before the count is updated causing
+        // the profiler to try to read it.
+        __atomic_store_n(&ls->count, ls->count + 1, __ATOMIC_RELEASE);
+        mutation_end(ls);
+        index_add(ls, ls->count - 1);
+        return 0;
+}
+
+static int push(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, unsigned char flags) {
+        if (published(ls))
+                return careful_push(ls, key, value, flags);
+        struct block *old_block;
+        int error = reserve(ls, 1, label_bytes(key, value, flags), &old_block);
+        if (error)
+                return error;
+        mutation_begin(ls);
+        ls->block->flags[ls->count] = flags;
+        ls->block->fingerprints[ls->count] = fingerprint(hash_bytes(key));
+        ls->storage[ls->count++] = label_copy_in(ls->block, key, value, flags);
+        mutation_end(ls);
+        index_add(ls, ls->count - 1);
+        block_unref(old_block);
+        return 0;
+}
+
+// swap_delete deletes the label `element`
+// by overwriting it with the last label and decrementing
+// `count` by one (thus changing the order of labels, but we don't care)
+static void careful_swap_delete(custom_labels_labelset_t *ls, custom_labels_label_t *element) {
+        assert(ls->count > 0);
+        STAT_INC(labels_deleted);
+        STAT_INC(careful_ops);
+        PROBE(careful_delete, ls, element->key.buf, element->key.len);
+        mutation_begin(ls);
+        custom_labels_label_t *last = ls->storage + ls->count - 1;
+        unsigned char *flags = &ls->block->flags[element - ls->storage];
+        index_swap_remove(ls, element - ls->storage);
+        if (element == last) {
+                __atomic_store_n(&ls->count, ls->count - 1, __ATOMIC_RELAXED);
+                // Make sure the memory is released after decrementing the count
+                // causing profilers to no longer try to read it.
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                careful_release_key(ls->block, element->key, *flags);
+                careful_release_value(ls->block, element->value, *flags);
+                mutation_end(ls);
+                return;
+        }
+        custom_labels_string_t old_key = element->key;
+        __atomic_store_n(&element->key.buf, NULL, __ATOMIC_RELAXED);
+        // The ABI specifies that profilers must ignore
+        // elements with null keys. So the element has now
+        // been deleted from the profiler's perspective.
+        //
+        // The barrier ensures that this is done before releasing the associated memory.
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        careful_release_key(ls->block, old_key, *flags);
+        careful_release_value(ls->block, element->value, *flags);
+        element->value = last->value;
+        element->key.len = last->key.len;
+        *flags = ls->block->flags[last - ls->storage];
+        ls->block->fingerprints[element - ls->storage] = ls->block->fingerprints[last - ls->storage];
+        // The element that was previously released is now equivalent to the last element,
+        // except that its `key.buf` has not been set. The barrier here ensures that
+        // everything is set up before doing that, so the profiler doesn't see any intermediate state.
+        __atomic_store_n(&element->key.buf, last->key.buf, __ATOMIC_RELEASE);
+        // Now there are two visible copies of the same label: both `element` and `last`.
+        // The ABI specifies that profilers are to ignore subsequent copies of labels for
+        // the same key, so this is fine.
+        //
+        // The barrier ensures that the label is visible in `element` before it's no longer visible
+        // in `last`.
+        __atomic_store_n(&ls->count, ls->count - 1, __ATOMIC_RELEASE);
+        mutation_end(ls);
+}
+
+void custom_labels_careful_delete(custom_labels_labelset_t *ls, custom_labels_string_t key) {
+        if (!ls || frozen(ls)) return;
+        custom_labels_label_t *old = get_mut(ls, key);
+        if (old) {
+                careful_swap_delete(ls, old);
+        }
+}
+
+void custom_labels_careful_delete_k(custom_labels_labelset_t *ls, custom_labels_key_t key) {
+        if (!ls || frozen(ls)) return;
+        custom_labels_label_t *old = get_mut_k(ls, key);
+        if (old) {
+                careful_swap_delete(ls, old);
+        }
+}
+
+// if error, no allocation
+static int custom_labels_string_clone(custom_labels_string_t s, custom_labels_string_t *new_out) {
+        if (!new_out)
+                return 0;
+        if (!s.buf) {
+                *new_out = {};
+                return 0;
+        }
+        unsigned char *new_buf = (unsigned char *)malloc(s.len);
+        if (!new_buf)
+                return errno;
+        STAT_INC(allocations);
+        STAT_ADD(bytes_allocated, s.len);
+        memcpy(new_buf, s.buf, s.len);
+        *new_out = (custom_labels_string_t) {s.len, new_buf };
+        return 0;
+}
+
+
+// Gives the existing label `old` of the current set a new value. The
+// label is hidden from profilers (by nulling its key, as in
+// `careful_swap_delete`) only while its value is replaced, so it keeps
+// its place and its key, and the bytes of its old value if the new one
+// fits in them. See `careful_push` for `flags`.
+static int careful_update(custom_labels_labelset_t *ls, custom_labels_label_t *old, custom_labels_string_t key, custom_labels_string_t value, unsigned char flags) {
+        size_t old_idx = old - ls->storage;
+        bool by_pointer = flags & LABEL_VALUE_BY_POINTER;
+        bool in_place = !by_pointer && value.len && value.len <= old->value.len &&
+                block_owns(ls->block, old->value.buf) && block_exclusive(ls->block);
+        struct block *old_block = NULL;
+        if (!by_pointer && !in_place) {
+                // Moving the set doesn't change its labels, so it
+                // doesn't need to be part of the mutation.
+                int error = reserve(ls, 0, value.len, &old_block);
+                if (error)
+                        return error;
+                old = &ls->storage[old_idx];
+        }
+        STAT_INC(careful_ops);
+        mutation_begin(ls);
+        // A reader that doesn't stop the thread may have picked up the
+        // value before the set became odd and read it while it's being
+        // overwritten, so the new value goes elsewhere if there's one.
+        if (in_place && may_be_read()) {
+                in_place = false;
+                int error = reserve(ls, 0, value.len, &old_block);
+                if (error) {
+                        mutation_end(ls);
+                        return error;
+                }
+                old = &ls->storage[old_idx];
+        }
+        unsigned char *old_flags = &ls->block->flags[old_idx];
+        const unsigned char *key_buf = old->key.buf;
+        __atomic_store_n(&old->key.buf, NULL, __ATOMIC_RELAXED);
+        // The barrier ensures that profilers ignore the label
+        // before its value starts changing under them.
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if (in_place) {
+                memmove((void *)old->value.buf, value.buf, value.len);
+                ls->block->garbage += old->value.len - value.len;
+                old->value.len = value.len;
+        } else {
+                careful_release_value(ls->block, old->value, *old_flags);
+                old->value = by_pointer ? value : block_copy_in(ls->block, value);
+        }
+        *old_flags = (*old_flags & ~LABEL_VALUE_FLAGS) | (flags & LABEL_VALUE_FLAGS);
+        // And that the new value is in place before they see the label again.
+        __atomic_store_n(&old->key.buf, key_buf, __ATOMIC_RELEASE);
+        mutation_end(ls);
+        careful_block_unref(old_block);
+        // The existing label keeps its key.
+        if (flags & LABEL_KEY_OWNED)
+                free((void *)key.buf);
+        return 0;
+}
+
+// Does the work of the careful `set` functions, once the existing label
+// for the key (if any) has been looked up. See `careful_push` for `flags`.
+static int careful_set_at(custom_labels_labelset_t *ls, custom_labels_label_t *old, custom_labels_string_t key, custom_labels_string_t value, unsigned char flags, custom_labels_string_t *old_value_out) {
+        int error;
+        if (frozen(ls))
+                return EPERM;
+        STAT_INC(labels_set);
+        PROBE(careful_set, ls, key.buf, key.len, value.buf, value.len);
+
+        if (old_value_out) {
+                if (old) {
+                        error = custom_labels_string_clone(old->value, old_value_out);
+                        if (error)
+                                return error;
+                } else {
+                  *old_value_out = {};
+                }
+        }
+        if (old)
+                return careful_update(ls, old, key, value, flags);
+        return careful_push(ls, key, value, flags);
+}
+
+int custom_labels_careful_set(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out) {
+        assert(key.buf);
+        return careful_set_at(ls, get_mut(ls, key), key, value, 0, old_value_out);
+}
+
+int custom_labels_careful_set_k(custom_labels_labelset_t *ls, custom_labels_key_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out) {
+        return careful_set_at(ls, get_mut_k(ls, key), key->str, value, LABEL_KEY_INTERNED, old_value_out);
+}
+
+// Releases the strings of all the labels in `ls`.
+static void release_labels(custom_labels_labelset_t *ls) {
+        for (size_t i = 0; i < ls->count; ++i) {
+                release_key(ls->block, ls->storage[i].key, ls->block->flags[i]);
+                release_value(ls->block, ls->storage[i].value, ls->block->flags[i]);
+        }
+}
+
+// When enabled with `custom_labels_pool_configure`, each thread keeps a
+// pool of label sets freed on it, along with their blocks, and hands
+// them back out from `custom_labels_new` and the clone functions.
+static size_t pool_max_sets = 0;
+static size_t pool_max_bytes = 0;
+
+// Set once the thread's pool has been emptied on exit. Sets freed after
+// that (e.g., by thread-specific data destructors) are freed outright.
+static thread_local bool pool_exiting = false;
+
+struct set_pool {
+        custom_labels_labelset_t *head;
+        custom_labels_pool_stats_t stats;
+
+        ~set_pool() {
+                pool_exiting = true;
+                while (head) {
+                        custom_labels_labelset_t *next = head->pool_next;
+                        block_unref(head->block);
+                        free(head);
+                        head = next;
+                }
+        }
+};
+
+static thread_local struct set_pool pool;
+
+// The number of bytes a pooled set takes up.
+static size_t pooled_size(const custom_labels_labelset_t *ls) {
+        size_t size = sizeof(custom_labels_labelset_t);
+        if (ls->block)
+                size += BLOCK_ALLOC_SIZE(ls->capacity, ls->block->size);
+        return size;
+}
+
+// Removes and returns a pooled set with room for at least `capacity`
+// labels and `size` bytes, or returns NULL if there is none.
+static custom_labels_labelset_t *pool_take(size_t capacity, size_t size) {
+        bool enabled = __atomic_load_n(&pool_max_sets, __ATOMIC_RELAXED);
+        if (pool_exiting || (!enabled && !pool.head))
+                return NULL;
+        for (custom_labels_labelset_t **p = &pool.head; *p; p = &(*p)->pool_next) {
+                custom_labels_labelset_t *ls = *p;
+                if (ls->capacity >= capacity && (ls->block ? ls->block->size : 0) >= size) {
+                        *p = ls->pool_next;
+                        --pool.stats.sets;
+                        pool.stats.bytes -= pooled_size(ls);
+                        ++pool.stats.hits;
+                        // It's a new set as far as profilers are concerned.
+                        ls->generation = new_generation();
+                        return ls;
+                }
+        }
+        if (enabled)
+                ++pool.stats.misses;
+        return NULL;
+}
+
+// Puts `ls`, whose labels have been released, into the pool
+// if there is room. Returns whether it did.
+static bool pool_put(custom_labels_labelset_t *ls) {
+        if (pool_exiting)
+                return false;
+        size_t max_sets = __atomic_load_n(&pool_max_sets, __ATOMIC_RELAXED);
+        size_t max_bytes = __atomic_load_n(&pool_max_bytes, __ATOMIC_RELAXED);
+        // Make room in the pool, or drop what's there if the limits
+        // have been lowered since.
+        while (pool.head && (pool.stats.sets >= max_sets || pool.stats.bytes + pooled_size(ls) > max_bytes)) {
+                custom_labels_labelset_t *victim = pool.head;
+                pool.head = victim->pool_next;
+                --pool.stats.sets;
+                pool.stats.bytes -= pooled_size(victim);
+                block_unref(victim->block);
+                free(victim);
+        }
+        if (!max_sets)
+                return false;
+        // Only a block that nothing else refers to can be reused;
+        // otherwise keep just the header.
+        if (ls->block && (ls->block->borrowed || !block_exclusive(ls->block))) {
+                block_unref(ls->block);
+                ls->block = NULL;
+                ls->tags = NULL;
+                ls->capacity = 0;
+        }
+        if (pooled_size(ls) > max_bytes) {
+                ++pool.stats.discarded;
+                return false;
+        }
+        if (ls->block) {
+                block_unref(ls->block->parent);
+                block_init(ls->block, ls->capacity, ls->block->size, false);
+        }
+        ls->storage = ls->block ? block_labels(ls->block) : NULL;
+        ls->count = 0;
+        ls->id = 0;
+        ls->refs = 0;
+        ls->unpublished = 0;
+        ls->pool_next = pool.head;
+        pool.head = ls;
+        ++pool.stats.sets;
+        pool.stats.bytes += pooled_size(ls);
+        ++pool.stats.recycled;
+        return true;
+}
+
+void custom_labels_pool_configure(size_t max_sets, size_t max_bytes) {
+        __atomic_store_n(&pool_max_sets, max_sets, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool_max_bytes, max_bytes, __ATOMIC_RELAXED);
+}
+
+void custom_labels_pool_stats(custom_labels_pool_stats_t *out) {
+        *out = pool.stats;
+}
+
+// Allocates an empty label set with room for `capacity` labels
+// and `size` bytes of keys and values.
+static custom_labels_labelset_t *new_with_size(size_t capacity, size_t size) {
+        custom_labels_labelset_t *ls = pool_take(capacity, size);
+        if (ls) {
+                STAT_INC(labelsets_created);
+                return ls;
+        }
+        ls = (custom_labels_labelset_t *)malloc(sizeof(custom_labels_labelset_t));
+        if (!ls)
+                return NULL;
+        STAT_INC(allocations);
+        STAT_ADD(bytes_allocated, sizeof(custom_labels_labelset_t));
+        *ls = (custom_labels_labelset_t) { NULL, 0, 0, new_generation(), NULL, NULL, NULL, NULL, 0, 0, 0 };
+        if (capacity || size) {
+                struct block *b = block_new(capacity, size);
+                if (!b) {
+                        free(ls);
+                        return NULL;
+                }
+                ls->storage = block_labels(b);
+                ls->capacity = capacity;
+                ls->tags = b->flags;
+                ls->block = b;
+        }
+        STAT_INC(labelsets_created);
+        return ls;
+}
+
+custom_labels_labelset_t *custom_labels_new(size_t capacity) {
+        return new_with_size(capacity, capacity * BYTES_PER_LABEL_HINT);
+}
+
+// Does the work of the non-careful `set` functions, once the existing label
+// for the key (if any) has been looked up. See `careful_push` for `flags`.
+static int set_at(custom_labels_labelset_t *ls, custom_labels_label_t *old, custom_labels_string_t key, custom_labels_string_t value, unsigned char flags, custom_labels_string_t *old_value_out) {
+        int error;
+        if (frozen(ls))
+                return EPERM;
+        STAT_INC(labels_set);
+        PROBE(set, ls, key.buf, key.len, value.buf, value.len);
+        if (old_value_out) {
+                if (old) {
+                        error = custom_labels_string_clone(old->value, old_value_out);
+                        if (error)
+                                return error;
+                } else {
+                        *old_value_out = {  };
+                }
+        }
+
+        if (old) {
+                mutation_begin(ls);
+                size_t old_idx = old - ls->storage;
+                unsigned char *old_flags = &ls->block->flags[old_idx];
+                if (flags & LABEL_VALUE_BY_POINTER) {
+                        release_value(ls->block, old->value, *old_flags);
+                        old->value = value;
+                // Overwrite the old value in place if it fits.
+                } else if (value.len && value.len <= old->value.len && block_owns(ls->block, old->value.buf) && block_exclusive(ls->block)) {
+                        memmove((void *)old->value.buf, value.buf, value.len);
+                        ls->block->garbage += old->value.len - value.len;
+                        old->value.len = value.len;
+                } else {
+                        struct block *old_block;
+                        error = reserve(ls, 0, value.len, &old_block);
+                        if (error) {
+                                mutation_end(ls);
+                                return error;
+                        }
+                        old = &ls->storage[old_idx];
+                        old_flags = &ls->block->flags[old_idx];
+                        release_value(ls->block, old->value, *old_flags);
+                        old->value = block_copy_in(ls->block, value);
+                        block_unref(old_block);
+                }
+                *old_flags = (*old_flags & ~LABEL_VALUE_FLAGS) | (flags & LABEL_VALUE_FLAGS);
+                mutation_end(ls);
+                // The existing label keeps its key.
+                if (flags & LABEL_KEY_OWNED)
+                        free((void *)key.buf);
+                return 0;
+        }
+        return push(ls, key, value, flags);
+}
+
+int custom_labels_set(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out) {
+        if (published(ls)) {
+                return custom_labels_careful_set(ls, key, value, old_value_out);
+        }
+        assert(key.buf);
+        return set_at(ls, get_mut(ls, key), key, value, 0, old_value_out);
+}
+
+int custom_labels_set_k(custom_labels_labelset_t *ls, custom_labels_key_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out) {
+        if (published(ls)) {
+                return custom_labels_careful_set_k(ls, key, value, old_value_out);
+        }
+        return set_at(ls, get_mut_k(ls, key), key->str, value, LABEL_KEY_INTERNED, old_value_out);
+}
+
+// Translates the `CUSTOM_LABELS_*` flags of `custom_labels_set_ex` into label flags.
+static unsigned char ex_label_flags(custom_labels_string_t *value, unsigned flags) {
+        unsigned char ret = 0;
+        if (flags & CUSTOM_LABELS_KEY_OWNED)
+                ret |= LABEL_KEY_OWNED;
+        else if (flags & CUSTOM_LABELS_KEY_BORROWED)
+                ret |= LABEL_KEY_BORROWED;
+        if (flags & CUSTOM_LABELS_VALUE_OWNED)
+                ret |= LABEL_VALUE_OWNED;
+        else if (flags & CUSTOM_LABELS_VALUE_BORROWED)
+                ret |= LABEL_VALUE_BORROWED;
+        // An empty value stored by pointer may well have a NULL `buf`,
+        // which profilers would read as "absent".
+        if (!value->buf) {
+                assert(!value->len);
+                *value = (custom_labels_string_t) {0, empty_buf};
+                ret &= ~LABEL_VALUE_BY_POINTER;
+        }
+        return ret;
+}
+
+int custom_labels_careful_set_ex(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, unsigned flags, custom_labels_string_t *old_value_out) {
+        assert(key.buf);
+        unsigned char label_flags = ex_label_flags(&value, flags);
+        return careful_set_at(ls, get_mut(ls, key), key, value, label_flags, old_value_out);
+}
+
+int custom_labels_set_ex(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, unsigned flags, custom_labels_string_t *old_value_out) {
+        if (published(ls)) {
+                return custom_labels_careful_set_ex(ls, key, value, flags, old_value_out);
+        }
+        assert(key.buf);
+        unsigned char label_flags = ex_label_flags(&value, flags);
+        return set_at(ls, get_mut(ls, key), key, value, label_flags, old_value_out);
+}
+
+// Typed values are stored as 8 little-endian bytes, with their type
+// in the label's flags.
+static int set_typed(custom_labels_labelset_t *ls, custom_labels_label_t *old, custom_labels_string_t key, uint64_t bits, unsigned type, unsigned char flags) {
+        unsigned char buf[8];
+        for (int i = 0; i < 8; ++i)
+                buf[i] = bits >> 8 * i;
+        custom_labels_string_t value = { sizeof(buf), buf };
+        flags |= type << LABEL_VALUE_TYPE_SHIFT;
+        if (published(ls))
+                return careful_set_at(ls, old, key, value, flags, NULL);
+        return set_at(ls, old, key, value, flags, NULL);
+}
+
+int custom_labels_set_u64(custom_labels_labelset_t *ls, custom_labels_string_t key, uint64_t value) {
+        assert(key.buf);
+        return set_typed(ls, get_mut(ls, key), key, value, CUSTOM_LABELS_VALUE_U64, 0);
+}
+
+int custom_labels_set_i64(custom_labels_labelset_t *ls, custom_labels_string_t key, int64_t value) {
+        assert(key.buf);
+        return set_typed(ls, get_mut(ls, key), key, value, CUSTOM_LABELS_VALUE_I64, 0);
+}
+
+int custom_labels_set_u64_k(custom_labels_labelset_t *ls, custom_labels_key_t key, uint64_t value) {
+        return set_typed(ls, get_mut_k(ls, key), key->str, value, CUSTOM_LABELS_VALUE_U64, LABEL_KEY_INTERNED);
+}
+
+int custom_labels_set_i64_k(custom_labels_labelset_t *ls, custom_labels_key_t key, int64_t value) {
+        return set_typed(ls, get_mut_k(ls, key), key->str, value, CUSTOM_LABELS_VALUE_I64, LABEL_KEY_INTERNED);
+}
+
+unsigned custom_labels_value_type(const custom_labels_labelset_t *ls, const custom_labels_label_t *lbl) {
+        return value_type(ls->tags, lbl - ls->storage);
+}
+
+static int get_typed(custom_labels_labelset_t *ls, custom_labels_string_t key, unsigned type, uint64_t *out) {
+        const custom_labels_label_t *lbl = get_mut(ls, key);
+        if (!lbl)
+                return ENOENT;
+        if (custom_labels_value_type(ls, lbl) != type)
+                return EINVAL;
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; ++i)
+                bits |= (uint64_t)lbl->value.buf[i] << 8 * i;
+        *out = bits;
+        return 0;
+}
+
+int custom_labels_get_u64(custom_labels_labelset_t *ls, custom_labels_string_t key, uint64_t *out) {
+        return get_typed(ls, key, CUSTOM_LABELS_VALUE_U64, out);
+}
+
+int custom_labels_get_i64(custom_labels_labelset_t *ls, custom_labels_string_t key, int64_t *out) {
+        return get_typed(ls, key, CUSTOM_LABELS_VALUE_I64, (uint64_t *)out);
+}
+
+// In a batch of labels passed in together, later labels win over
+// earlier ones with the same key, just as if they had been set one
+// after the other. Batches of at least this many labels find the
+// labels that are overridden by sorting the hashes of their keys,
+// rather than comparing every pair.
+#define BATCH_SORT_MIN_LABELS INDEX_MIN_LABELS
+
+// Whether the label at `i` in the batch `labels` of `n`
+// is overridden, found by comparing it with every later one.
+static bool overridden_later(const custom_labels_label_t *labels, size_t n, size_t i) {
+        for (size_t j = i + 1; j < n; ++j)
+                if (eq(labels[i].key, labels[j].key))
+                        return true;
+        return false;
+}
+
+struct key_ref {
+        uint64_t hash;
+        size_t pos;
+};
 
-        return 0;
+static int key_ref_cmp(const void *l, const void *r) {
+        const struct key_ref *a = (const struct key_ref *)l;
+        const struct key_ref *b = (const struct key_ref *)r;
+        if (a->hash != b->hash)
+                return a->hash < b->hash ? -1 : 1;
+        return (a->pos > b->pos) - (a->pos < b->pos);
 }
 
-static custom_labels_label_t *get_mut(custom_labels_labelset_t *ls, custom_labels_string_t key) {
-        for (size_t i = 0; i < ls->count; ++i) {
-                if (!ls->storage[i].key.buf) {
-                        continue;
-                }
-                if (eq(ls->storage[i].key, key)) {
-                        return &ls->storage[i];
+// The keys of a batch of labels, sorted by hash (and then position).
+struct batch_keys {
+        struct key_ref *refs;
+        // Whether each label is overridden by a later one.
+        bool *overridden;
+};
+
+// Sorts the keys of the batch `labels` of `n`. Returns false
+// if there's no memory for it.
+static bool batch_keys_init(struct batch_keys *k, const custom_labels_label_t *labels, size_t n) {
+        k->refs = (struct key_ref *)malloc(n * (sizeof(struct key_ref) + sizeof(bool)));
+        if (!k->refs)
+                return false;
+        k->overridden = (bool *)(k->refs + n);
+        for (size_t i = 0; i < n; ++i) {
+                k->refs[i] = (struct key_ref) { hash_bytes(labels[i].key), i };
+                k->overridden[i] = false;
+        }
+        qsort(k->refs, n, sizeof(struct key_ref), key_ref_cmp);
+        // Only labels whose keys have the same hash need comparing,
+        // and those are next to each other, in order of position.
+        for (size_t run = 0, end; run < n; run = end) {
+                for (end = run + 1; end < n && k->refs[end].hash == k->refs[run].hash; ++end)
+                        ;
+                for (size_t a = run; a < end; ++a) {
+                        for (size_t b = a + 1; b < end && !k->overridden[k->refs[a].pos]; ++b)
+                                k->overridden[k->refs[a].pos] = eq(labels[k->refs[a].pos].key, labels[k->refs[b].pos].key);
                 }
         }
-        return NULL;
+        return true;
 }
 
-const custom_labels_label_t *custom_labels_get(custom_labels_labelset_t *ls, custom_labels_string_t key) {
-        return get_mut(ls, key);
+// Whether `key`, whose hash is `hash`, is the key of any
+// label of the batch `labels` of `n`, sorted into `k`.
+static bool batch_has_key(const struct batch_keys *k, const custom_labels_label_t *labels, size_t n, custom_labels_string_t key, uint64_t hash) {
+        size_t lo = 0, hi = n;
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (k->refs[mid].hash < hash)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        for (; lo < n && k->refs[lo].hash == hash; ++lo)
+                if (eq(labels[k->refs[lo].pos].key, key))
+                        return true;
+        return false;
 }
 
-// `push` pushes a new element onto the current set's vector of labels.
-// `key` must not be the same as any existing label's key, which must
-// be checked by the caller.
-static int careful_push(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value) {
-        if (ls->count == ls->capacity) {
-                size_t new_cap = MAX(2 * ls->capacity, 1);
-                custom_labels_label_t *new_storage = (custom_labels_label_t *)malloc(sizeof(custom_labels_label_t) * new_cap);
-                if (!new_storage) {
-                        return errno;
-                }
-                memcpy(new_storage, ls->storage, sizeof(custom_labels_label_t) * ls->count);
-                custom_labels_label_t *old_storage = ls->storage;
-                // Need barriers on both sides because we have to prepare
-                // the new storage, then point to it, then free the old storage,
-                // in that order.
-                BARRIER;
-                ls->storage = new_storage;
-                BARRIER;
-                ls->capacity = new_cap;
-                free(old_storage);
-        }
-        unsigned char *new_key_buf = (unsigned char *)malloc(key.len);
-        if (!new_key_buf) {
+static void batch_keys_free(struct batch_keys *k) {
+        free(k->refs);
+}
+
+// What `custom_labels_set_many` does with each label: overwrite the
+// label at this position in `storage`, or one of the following.
+#define PLAN_NEW SIZE_MAX
+#define PLAN_SKIP (SIZE_MAX - 1)
+
+// Small batches are planned on the stack.
+#define PLAN_STACK_SIZE 16
+
+// All the labels are applied in a single mutation, on both paths: the
+// set is grown at most once, new labels are published with one update
+// of `count`, and overwritten labels are hidden (by nulling their keys)
+// only while their values are replaced.
+int custom_labels_set_many(custom_labels_labelset_t *ls, const custom_labels_label_t *labels, size_t n) {
+        if (frozen(ls))
+                return EPERM;
+        PROBE(set_many, ls, labels, n);
+        size_t stack_plan[PLAN_STACK_SIZE];
+        size_t *plan = n <= PLAN_STACK_SIZE ? stack_plan : (size_t *)malloc(n * sizeof(size_t));
+        if (!plan)
                 return errno;
+        size_t n_new = 0;
+        size_t n_applied = 0;
+        size_t n_bytes = 0;
+        struct batch_keys keys;
+        bool sorted = n >= BATCH_SORT_MIN_LABELS && batch_keys_init(&keys, labels, n);
+        for (size_t i = 0; i < n; ++i) {
+                assert(labels[i].key.buf);
+                if (sorted ? keys.overridden[i] : overridden_later(labels, n, i)) {
+                        plan[i] = PLAN_SKIP;
+                        continue;
+                }
+                ++n_applied;
+                custom_labels_label_t *old = get_mut(ls, labels[i].key);
+                plan[i] = old ? (size_t)(old - ls->storage) : PLAN_NEW;
+                n_bytes += labels[i].value.len;
+                if (!old) {
+                        n_bytes += labels[i].key.len;
+                        ++n_new;
+                }
         }
-        memcpy(new_key_buf, key.buf, key.len);
-        unsigned char *new_value_buf = (unsigned char *)malloc(value.len);
-        if (!new_value_buf) {
-                free(new_key_buf);
-                return errno;
+        if (sorted)
+                batch_keys_free(&keys);
+        struct block *old_block;
+        int error = reserve(ls, n_new, n_bytes, &old_block);
+        if (error) {
+                if (plan != stack_plan)
+                        free(plan);
+                return error;
         }
-        memcpy(new_value_buf, value.buf, value.len);
-        custom_labels_string_t new_key = {key.len, new_key_buf};
-        custom_labels_string_t new_value = {value.len, new_value_buf};
-        ls->storage[ls->count] = (custom_labels_label_t) {new_key, new_value};
-        // Make sure the new item is written before the count is updated causing
-        // the profiler to try to read it.
-        BARRIER;
-        ++ls->count;
-        return 0;
-}
 
-static int push(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value) {
+        STAT_ADD(labels_set, n_applied);
         if (ls == custom_labels_current_set)
-                return careful_push(ls, key, value);
-        if (ls->count == ls->capacity) {
-                size_t new_cap = MAX(2 * ls->capacity, 1);
-                ls->storage = (custom_labels_label_t *)realloc(ls->storage, new_cap * sizeof(custom_labels_label_t));
-                ls->capacity = new_cap;
-                if (!ls->storage)
-                        return errno;
-        }
-        unsigned char *new_key_buf = (unsigned char *)malloc(key.len);
-        if (!new_key_buf) {
-                return errno;
+                STAT_INC(careful_ops);
+        mutation_begin(ls);
+        size_t count = ls->count;
+        for (size_t i = 0; i < n; ++i) {
+                if (plan[i] == PLAN_SKIP)
+                        continue;
+                custom_labels_string_t value = labels[i].value;
+                if (!value.buf)
+                        value = (custom_labels_string_t) {0, empty_buf};
+                if (plan[i] == PLAN_NEW) {
+                        // Invisible to profilers until `count` is updated.
+                        ls->storage[count] = label_copy_in(ls->block, labels[i].key, value, 0);
+                        ls->block->flags[count] = 0;
+                        ls->block->fingerprints[count++] = fingerprint(hash_bytes(labels[i].key));
+                        continue;
+                }
+                custom_labels_label_t *lbl = &ls->storage[plan[i]];
+                unsigned char *flags = &ls->block->flags[plan[i]];
+                const unsigned char *key_buf = lbl->key.buf;
+                // As in `careful_swap_delete`, profilers ignore the
+                // label while its key is null.
+                __atomic_store_n(&lbl->key.buf, NULL, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                careful_release_value(ls->block, lbl->value, *flags);
+                lbl->value = block_copy_in(ls->block, value);
+                *flags &= ~LABEL_VALUE_FLAGS;
+                __atomic_store_n(&lbl->key.buf, key_buf, __ATOMIC_RELEASE);
         }
-        memcpy(new_key_buf, key.buf, key.len);
-        unsigned char *new_value_buf = (unsigned char *)malloc(value.len);
-        if (!new_value_buf) {
-                free(new_key_buf);
-                return errno;
+        // Publish all the new labels at once.
+        size_t first_new = ls->count;
+        __atomic_store_n(&ls->count, count, __ATOMIC_RELEASE);
+        mutation_end(ls);
+        if (ls->index) {
+                // `index_add` would rebuild the index with all the new
+                // labels, and then add them again.
+                if (2 * count > ls->index->mask + 1)
+                        index_build(ls, 2 * count);
+                else
+                        for (size_t i = first_new; i < count; ++i)
+                                index_insert(ls, i);
         }
-        memcpy(new_value_buf, value.buf, value.len);
-        custom_labels_string_t new_key = {key.len, new_key_buf};
-        custom_labels_string_t new_value = {value.len, new_value_buf};
-        ls->storage[ls->count++] = (custom_labels_label_t) {new_key, new_value};
+        careful_block_unref(old_block);
+        if (plan != stack_plan)
+                free(plan);
         return 0;
 }
 
-// swap_delete deletes the label `element`
-// by overwriting it with the last label and decrementing
-// `count` by one (thus changing the order of labels, but we don't care)
-static void careful_swap_delete(custom_labels_labelset_t *ls, custom_labels_label_t *element) {
-        assert(ls->count > 0);
-        custom_labels_label_t *last = ls->storage + ls->count - 1;
-        if (element == last) {
-                --ls->count;
-                // Make sure memory is freed after decrementing the count
-                // causing profilers to no longer try to read it.
-                BARRIER;
-                free((void*)element->key.buf);
-                free((void*)element->value.buf);
+// The labels are hidden one by one by nulling their keys, then the
+// survivors beyond the new end of `storage` are moved into the holes
+// they left, and finally the set is shrunk with one update of `count`.
+void custom_labels_delete_many(custom_labels_labelset_t *ls, const custom_labels_string_t *keys, size_t n) {
+        if (!ls || frozen(ls))
                 return;
+        PROBE(delete_many, ls, keys, n);
+        // The index can't follow the moves below, so it's rebuilt the
+        // next time it's needed, and until then the set is scanned,
+        // which skips the labels already deleted in this batch.
+        index_drop(ls);
+        size_t n_deleted = 0;
+        for (size_t i = 0; i < n; ++i) {
+                custom_labels_label_t *lbl = scan(ls, keys[i], hash_bytes(keys[i]));
+                if (!lbl)
+                        continue;
+                if (!n_deleted++)
+                        mutation_begin(ls);
+                size_t pos = lbl - ls->storage;
+                custom_labels_string_t key = lbl->key;
+                __atomic_store_n(&lbl->key.buf, NULL, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                careful_release_key(ls->block, key, ls->block->flags[pos]);
+                careful_release_value(ls->block, lbl->value, ls->block->flags[pos]);
         }
-        custom_labels_string_t old_key = element->key;
-        element->key.buf = NULL;
-        // The ABI specifies that profilers must ignore
-        // elements with null keys. So the element has now
-        // been deleted from the profiler's perspective.
-        //
-        // The barrier ensures that this is done before freeing the associated memory.
-        BARRIER;
-        free((void*)old_key.buf);
-        free((void*)element->value.buf);
-        element->value = last->value;
-        element->key.len = last->key.len;
-        // The element that was previously freed is now equivalent to the last element,
-        // except that its `key.buf` has not been set. The barrier here ensures that
-        // everything is set up before doing that, so the profiler doesn't see any intermediate state.
-        BARRIER;
-        element->key.buf = last->key.buf;
-        // Now there are two visible copies of the same label: both `element` and `last`.
-        // The ABI specifies that profilers are to ignore subsequent copies of labels for
-        // the same key, so this is fine.
-        //
-        // The barrier ensures that the label is visible in `element` before it's no longer visible
-        // in `last`.
-        BARRIER;
-        --ls->count;
-}
-
-void custom_labels_careful_delete(custom_labels_labelset_t *ls, custom_labels_string_t key) {
-        if (!ls) return;
-        custom_labels_label_t *old = get_mut(ls, key);
-        if (old) {
-                careful_swap_delete(ls, old);
+        if (!n_deleted)
+                return;
+        STAT_ADD(labels_deleted, n_deleted);
+        if (ls == custom_labels_current_set)
+                STAT_INC(careful_ops);
+        size_t count = ls->count - n_deleted;
+        size_t from = ls->count;
+        for (size_t hole = 0; hole < count; ++hole) {
+                if (ls->storage[hole].key.buf)
+                        continue;
+                do
+                        --from;
+                while (!ls->storage[from].key.buf);
+                custom_labels_label_t *src = &ls->storage[from];
+                custom_labels_label_t *dst = &ls->storage[hole];
+                dst->value = src->value;
+                dst->key.len = src->key.len;
+                ls->block->flags[hole] = ls->block->flags[from];
+                ls->block->fingerprints[hole] = ls->block->fingerprints[from];
+                // The label is now in two places, which profilers
+                // handle by ignoring the second.
+                __atomic_store_n(&dst->key.buf, src->key.buf, __ATOMIC_RELEASE);
         }
+        __atomic_store_n(&ls->count, count, __ATOMIC_RELEASE);
+        mutation_end(ls);
 }
 
-// if error, no allocation
-static int custom_labels_string_clone(custom_labels_string_t s, custom_labels_string_t *new_out) {
-        if (!new_out)
-                return 0;
-        if (!s.buf) {
-                *new_out = {};
-                return 0;
+// Frees everything `ls` owns, but not `ls` itself, retiring whatever
+// readers on other threads may have seen.
+static void careful_destroy(custom_labels_labelset_t *ls) {
+        for (size_t i = 0; i < ls->count; ++i) {
+                careful_release_key(ls->block, ls->storage[i].key, ls->block->flags[i]);
+                careful_release_value(ls->block, ls->storage[i].value, ls->block->flags[i]);
         }
-        unsigned char *new_buf = (unsigned char *)malloc(s.len);
-        if (!new_buf)
-                return errno;
-        memcpy(new_buf, s.buf, s.len);
-        *new_out = (custom_labels_string_t) {s.len, new_buf };
-        return 0;
+        index_drop(ls);
+        careful_block_unref(ls->block);
 }
 
-
-int custom_labels_careful_set(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out) {
-        int error;
-        
-        assert(key.buf);
-        custom_labels_label_t *old = get_mut(ls, key);
-        if (old_value_out) {
-                if (old) {
-                        error = custom_labels_string_clone(old->value, old_value_out);
-                        if (error)
-                                return error;
-                } else {
-                  *old_value_out = {};
-                }
-        }
-        int old_idx = old ? old - ls->storage : -1;
-        int ret = careful_push(ls, key, value);
-        if (ret) {
-                return ret;
-        }
-        if (old_idx >= 0) {
-                careful_swap_delete(ls, &ls->storage[old_idx]);
-        }
-        return 0;        
+// Frees `ls`, whose last reference has been dropped.
+static void free_set(void *p) {
+        custom_labels_labelset_t *ls = (custom_labels_labelset_t *)p;
+        release_labels(ls);
+        index_drop(ls);
+        if (!reclaim_exiting && pool_put(ls))
+                return;
+        block_unref(ls->block);
+        free(ls);
 }
 
-custom_labels_labelset_t *custom_labels_new(size_t capacity) {
-        custom_labels_labelset_t *ls = (custom_labels_labelset_t *)malloc(sizeof(custom_labels_labelset_t));
+void custom_labels_free(custom_labels_labelset_t *ls) {        
         if (!ls)
-                return NULL;
-        custom_labels_label_t *storage = (custom_labels_label_t *)calloc(capacity, sizeof(custom_labels_label_t));
-        if (!storage) {
-                free(ls);
-                return NULL;
-        }
-        *ls = (custom_labels_labelset_t) { storage, 0, capacity };
-        return ls;
+                return;
+        if (frozen(ls) && __atomic_sub_fetch(&ls->refs, 1, __ATOMIC_ACQ_REL))
+                return;
+        assert(ls != custom_labels_current_set);
+        STAT_INC(labelsets_freed);
+        PROBE(free, ls);
+        // Readers on other threads may still be reading it,
+        // if it was installed until recently.
+        retire(ls, pooled_size(ls), free_set);
 }
 
-int custom_labels_set(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out) {
-        int error;
-        if (ls == custom_labels_current_set) {
-                return custom_labels_careful_set(ls, key, value, old_value_out);
-        }
-        assert(key.buf);
-        custom_labels_label_t *old = get_mut(ls, key);
-        if (old_value_out) {
-                if (old) {
-                        error = custom_labels_string_clone(old->value, old_value_out);
-                        if (error)
-                                return error;
-                } else {
-                        *old_value_out = {  };
-                }
-        }
+void custom_labels_freeze(custom_labels_labelset_t *ls) {
+        if (frozen(ls))
+                return;
+        // Lookups can't build the index once the set is shared.
+        if (ls->count >= INDEX_MIN_LABELS && !ls->index)
+                index_build(ls, ls->count);
+        ls->refs = 1;
+}
 
-        if (old) {
-                unsigned char *new_value_buf = (unsigned char *)malloc(value.len);
-                if (!new_value_buf) {
-                        return errno;
-                }
-                memcpy(new_value_buf, value.buf, value.len);
-                free((void *)old->value.buf);
+custom_labels_labelset_t *custom_labels_retain(custom_labels_labelset_t *ls) {
+        assert(frozen(ls));
+        __atomic_add_fetch(&ls->refs, 1, __ATOMIC_RELAXED);
+        return ls;
+}
 
-                old->value = (custom_labels_string_t){ value.len, new_value_buf };
-                return 0;
-        }
-        return push(ls, key, value);
+int custom_labels_is_frozen(const custom_labels_labelset_t *ls) {
+        return frozen(ls);
 }
 
-void custom_labels_free(custom_labels_labelset_t *ls) {        
-        if (!ls)
-                return;
-        assert(ls != custom_labels_current_set);
-        for (size_t i = 0; i < ls->count; ++i) {
-                free((void *)ls->storage[i].key.buf);
-                free((void *)ls->storage[i].value.buf);
-        }
-        free(ls->storage);
-        free(ls);
+// This is like swap_delete, but far simpler due to not needing barriers
+static void swap_delete(custom_labels_labelset_t *ls, custom_labels_label_t *element) {
+        assert(ls->count > 0);
+        STAT_INC(labels_deleted);
+        PROBE(delete, ls, element->key.buf, element->key.len);
+        mutation_begin(ls);
+        custom_labels_label_t *last = &ls->storage[ls->count - 1];
+        unsigned char *flags = &ls->block->flags[element - ls->storage];
+        index_swap_remove(ls, element - ls->storage);
+        release_key(ls->block, element->key, *flags);
+        release_value(ls->block, element->value, *flags);
+        *element = *last;
+        *flags = ls->block->flags[last - ls->storage];
+        ls->block->fingerprints[element - ls->storage] = ls->block->fingerprints[last - ls->storage];
+        --ls->count;
+        mutation_end(ls);
 }
 
 void custom_labels_delete(custom_labels_labelset_t *ls, custom_labels_string_t key) {
-        if (!ls)
+        if (!ls || frozen(ls))
                 return;
-        if (ls == custom_labels_current_set) {
+        if (published(ls)) {
                 return custom_labels_careful_delete(ls, key);
         }
         custom_labels_label_t *old = get_mut(ls, key);
         if (old) {
-                // this block is like swap_delete, but far simpler due to not needing barriers
-                assert(ls->count > 0); // impossible to be empty if we got here.
-                custom_labels_label_t *last = &ls->storage[ls->count - 1];
-                free((void *)old->key.buf);
-                free((void *)old->value.buf);
-                *old = *last;
-                --ls->count;
+                swap_delete(ls, old);
+        }
+}
+
+void custom_labels_delete_k(custom_labels_labelset_t *ls, custom_labels_key_t key) {
+        if (!ls || frozen(ls))
+                return;
+        if (published(ls)) {
+                return custom_labels_careful_delete_k(ls, key);
+        }
+        custom_labels_label_t *old = get_mut_k(ls, key);
+        if (old) {
+                swap_delete(ls, old);
         }
 }
 
 custom_labels_labelset_t *custom_labels_replace(custom_labels_labelset_t *ls) {
+        STAT_INC(replaces);
         custom_labels_labelset_t *old = custom_labels_current_set;
+        PROBE(replace, ls, old);
+        // Profilers that see an ID use it instead of the set, so the old
+        // set's ID has to be gone before the set changes.
+        __atomic_store_n(&custom_labels_current_id, 0, __ATOMIC_RELAXED);
         // Whatever operations the user tried to do on `ls` have to be finished
         // before we install it
-        BARRIER;        
-        custom_labels_current_set = ls;
+        __atomic_store_n(&custom_labels_current_set, ls, __ATOMIC_RELEASE);
         // likewise, we need to have installed it before
         // the user tries to do anything with the old one.
-        BARRIER;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        // Readers on other threads may have picked up the old set
+        // just before, so it's changed carefully for a while.
+        if (old && !frozen(old))
+                old->unpublished = UNPUBLISHED_NOW;
+        __atomic_store_n(&custom_labels_current_id, ls ? ls->id : 0, __ATOMIC_RELEASE);
         return old;
 }
 
-static int custom_labels_label_clone(custom_labels_label_t lbl, custom_labels_label_t *new_out) {
-        if (!new_out)
-                return 0;
-
-        int error;
-        error = custom_labels_string_clone(lbl.key, &new_out->key);
-        if (error) {
-                return error;
-        }
+// Whether a clone can point at the key of a label with the given
+// flags rather than copying it in, given whether it shares the blocks
+// of the original.
+static bool clone_shares_key(unsigned char flags, bool shared) {
+        return (flags & LABEL_KEY_INTERNED) || (shared && !(flags & LABEL_KEY_BY_POINTER));
+}
 
-        error = custom_labels_string_clone(lbl.value, &new_out->value);
-        if (error) {
-                free((void *)new_out->key.buf);
-                return error;
-        }
-        return 0;
+// Like `clone_shares_key`, for values.
+static bool clone_shares_value(unsigned char flags, bool shared) {
+        return shared && !(flags & LABEL_VALUE_BY_POINTER);
 }
 
+// The clone shares the strings that live in the blocks of `ls` by
+// holding a reference to its block, and copies the rest, except for
+// interned keys. In particular, it neither shares ownership of nor
+// borrows the strings that `ls` does.
 custom_labels_labelset_t *custom_labels_clone_with_capacity(const custom_labels_labelset_t *ls, size_t capacity) {
-        custom_labels_labelset_t *new_ = custom_labels_new(capacity);
+        capacity = MAX(capacity, ls->count);
+        // Blocks that belong to someone else (i.e., those of scopes)
+        // don't live long enough to be shared.
+        bool shared = ls->count && !ls->block->borrowed && ls->block->depth < MAX_SHARE_DEPTH;
+        size_t size = (capacity - ls->count) * BYTES_PER_LABEL_HINT;
+        for (size_t i = 0; i < ls->count; ++i) {
+                unsigned char flags = ls->block->flags[i];
+                if (!clone_shares_key(flags, shared))
+                        size += ls->storage[i].key.len;
+                if (!clone_shares_value(flags, shared))
+                        size += ls->storage[i].value.len;
+        }
+        custom_labels_labelset_t *new_ = new_with_size(capacity, size);
         if (!new_)
                 return NULL;
+        if (shared)
+                block_set_parent(new_->block, ls->block);
         for (size_t i = 0; i < ls->count; ++i) {
-                int ret = custom_labels_label_clone(ls->storage[i], &new_->storage[i]);
-                if (ret) {
-                        new_->count = i;
-                        custom_labels_free(new_);
-                        return NULL;
-                }
+                unsigned char flags = ls->block->flags[i];
+                custom_labels_label_t lbl = ls->storage[i];
+                if (!clone_shares_key(flags, shared))
+                        lbl.key = block_copy_in(new_->block, lbl.key);
+                if (!clone_shares_value(flags, shared))
+                        lbl.value = block_copy_in(new_->block, lbl.value);
+                new_->storage[i] = lbl;
+                new_->block->flags[i] = flags & (LABEL_KEY_INTERNED | LABEL_VALUE_TYPE);
+                new_->block->fingerprints[i] = ls->block->fingerprints[i];
         }
         new_->count = ls->count;
+        new_->id = ls->id;
         return new_;
 }
 
@@ -378,18 +2256,174 @@ custom_labels_labelset_t *custom_labels_current() {
         return custom_labels_current_set;
 }
 
-#define CUSTOM_LABELS_RUN_WITH_IMPL(set_func) \
+static void put_u32(unsigned char *p, uint32_t n) {
+        p[0] = n;
+        p[1] = n >> 8;
+        p[2] = n >> 16;
+        p[3] = n >> 24;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+        return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#define SNAPSHOT_HEADER_SIZE 6
+
+// Writes as many of the `count` labels at `storage`, whose flags are
+// `tags`, as fit in the `cap` bytes at `out` in the snapshot encoding
+// (see `custom_labels_snapshot_current`), skipping labels with null
+// keys and, if `dedup`, all but the first label for any key. Sets
+// `*written_out` to the number of bytes written, and returns the
+// number that the whole encoding takes up.
+//
+// This is async-signal-safe; see `custom_labels_snapshot_current`.
+static size_t encode(const custom_labels_label_t *storage, const unsigned char *tags, size_t count, bool dedup, unsigned char *out, size_t cap, size_t *written_out) {
+        unsigned char decimal[DECIMAL_MAX];
+        unsigned char flags = 0;
+        size_t size = SNAPSHOT_HEADER_SIZE;
+        size_t pos = SNAPSHOT_HEADER_SIZE;
+        uint32_t n = 0;
+        for (size_t i = 0; i < count; ++i) {
+                custom_labels_label_t lbl = storage[i];
+                if (!lbl.key.buf)
+                        continue;
+                bool duplicate = false;
+                for (size_t j = 0; dedup && j < i && !duplicate; ++j)
+                        duplicate = storage[j].key.buf && eq(storage[j].key, lbl.key);
+                if (duplicate)
+                        continue;
+                lbl.value = value_text(tags, i, lbl.value, decimal);
+                size_t record = 8 + lbl.key.len + lbl.value.len;
+                size += record;
+                // Once a label doesn't fit, none of the rest are
+                // written, but they still count towards the size.
+                if (flags || cap < pos || cap - pos < record) {
+                        flags |= CUSTOM_LABELS_SNAPSHOT_TRUNCATED;
+                        continue;
+                }
+                put_u32(out + pos, lbl.key.len);
+                memcpy(out + pos + 4, lbl.key.buf, lbl.key.len);
+                pos += 4 + lbl.key.len;
+                put_u32(out + pos, lbl.value.len);
+                memcpy(out + pos + 4, lbl.value.buf, lbl.value.len);
+                pos += 4 + lbl.value.len;
+                ++n;
+        }
+        if (cap < SNAPSHOT_HEADER_SIZE) {
+                *written_out = 0;
+                return size;
+        }
+        out[0] = CUSTOM_LABELS_SNAPSHOT_VERSION;
+        out[1] = flags;
+        put_u32(out + 2, n);
+        *written_out = pos;
+        return size;
+}
+
+// This may interrupt any of the functions in this file, so it reads the
+// current set just like a profiler does, by the rules of the ABI, and
+// doesn't trust anything that isn't part of it (like the index).
+size_t custom_labels_snapshot_current(void *buf, size_t cap) {
+        const custom_labels_labelset_t *ls = __atomic_load_n(&custom_labels_current_set, __ATOMIC_RELAXED);
+        size_t count = ls ? __atomic_load_n(&ls->count, __ATOMIC_RELAXED) : 0;
+        const custom_labels_label_t *storage = ls ? __atomic_load_n(&ls->storage, __ATOMIC_RELAXED) : NULL;
+        const unsigned char *tags = ls ? __atomic_load_n(&ls->tags, __ATOMIC_RELAXED) : NULL;
+        size_t written;
+        encode(storage, tags, count, true, (unsigned char *)buf, cap, &written);
+        return written;
+}
+
+// Outside of a careful change, which can't be in progress here, a set
+// never has two labels with the same key, so there's no need to look
+// for duplicates.
+size_t custom_labels_encode_into(const custom_labels_labelset_t *ls, void *buf, size_t cap) {
+        size_t written;
+        if (!ls)
+                return encode(NULL, NULL, 0, false, (unsigned char *)buf, cap, &written);
+        return encode(ls->storage, ls->tags, ls->count, false, (unsigned char *)buf, cap, &written);
+}
+
+// Checks that the `len` bytes at `in` are an encoded label set,
+// returning the number of labels in it, or -1 if they aren't.
+static int64_t decode_check(const unsigned char *in, size_t len) {
+        if (len < SNAPSHOT_HEADER_SIZE || in[0] != CUSTOM_LABELS_SNAPSHOT_VERSION)
+                return -1;
+        uint32_t n = get_u32(in + 2);
+        size_t pos = SNAPSHOT_HEADER_SIZE;
+        for (uint64_t i = 0; i < 2 * (uint64_t)n; ++i) {
+                if (len - pos < 4 || len - pos - 4 < get_u32(in + pos))
+                        return -1;
+                pos += 4 + get_u32(in + pos);
+        }
+        return pos == len ? (int64_t)n : -1;
+}
+
+// The encoding is checked in full first, so that
+// nothing is added to the set if it's malformed.
+int custom_labels_decode_into(custom_labels_labelset_t *ls, const void *buf, size_t len, unsigned flags) {
+        const unsigned char *in = (const unsigned char *)buf;
+        if (flags & (CUSTOM_LABELS_KEY_OWNED | CUSTOM_LABELS_VALUE_OWNED))
+                return EINVAL;
+        int64_t n = decode_check(in, len);
+        if (n < 0)
+                return EINVAL;
+        size_t pos = SNAPSHOT_HEADER_SIZE;
+        for (int64_t i = 0; i < n; ++i) {
+                custom_labels_string_t strs[2];
+                for (int k = 0; k < 2; ++k) {
+                        strs[k].len = get_u32(in + pos);
+                        strs[k].buf = in + pos + 4;
+                        pos += 4 + strs[k].len;
+                }
+                int error = custom_labels_set_ex(ls, strs[0], strs[1], flags, NULL);
+                if (error)
+                        return error;
+        }
+        return 0;
+}
+
+int custom_labels_decode(const void *buf, size_t len, unsigned flags, custom_labels_labelset_t **out) {
+        int64_t n = decode_check((const unsigned char *)buf, len);
+        if (n < 0)
+                return EINVAL;
+        // Borrowed strings take up no room in the set.
+        size_t size = 0;
+        if ((flags & (CUSTOM_LABELS_KEY_BORROWED | CUSTOM_LABELS_VALUE_BORROWED)) !=
+            (CUSTOM_LABELS_KEY_BORROWED | CUSTOM_LABELS_VALUE_BORROWED))
+                size = len;
+        custom_labels_labelset_t *ls = new_with_size(n, size);
+        if (!ls)
+                return errno;
+        int error = custom_labels_decode_into(ls, buf, len, flags);
+        if (error) {
+                custom_labels_free(ls);
+                return error;
+        }
+        *out = ls;
+        return 0;
+}
+
+// The old value of a label changed by `custom_labels_run_with`, which
+// is put back afterwards along with its type.
+struct saved_value {
+        custom_labels_string_t value;
+        unsigned type;
+};
+
+#define CUSTOM_LABELS_RUN_WITH_IMPL(set_func, careful) \
         int error; \
-        custom_labels_string_t *values = (custom_labels_string_t *)malloc(n * sizeof(custom_labels_string_t)); \
-        if (!values) \
+        struct saved_value *saved = (struct saved_value *)malloc(n * sizeof(struct saved_value)); \
+        if (!saved) \
                 return errno; \
         for (int i = 0; i < n; ++i) { \
-                error = set_func(ls, labels[i].key, labels[i].value, &values[i]); \
+                const custom_labels_label_t *old = get_mut(ls, labels[i].key); \
+                saved[i].type = old ? value_type(ls->tags, old - ls->storage) : CUSTOM_LABELS_VALUE_BYTES; \
+                error = set_func(ls, labels[i].key, labels[i].value, &saved[i].value); \
                 if (error) { \
                         for (int j = 0; j < i; ++j) { \
-                                free((void *)values[j].buf); \
+                                free((void *)saved[j].value.buf); \
                         } \
-                        free(values); \
+                        free(saved); \
                         return error; \
                 } \
         } \
@@ -399,24 +2433,226 @@ custom_labels_labelset_t *custom_labels_current() {
         } \
         error = 0; \
         for (int i = 0; i < n; ++i) { \
-                error = set_func(ls, labels[i].key, values[i], NULL); \
+                custom_labels_label_t *old = get_mut(ls, labels[i].key); \
+                unsigned char flags = saved[i].type << LABEL_VALUE_TYPE_SHIFT; \
+                if (careful) \
+                        error = careful_set_at(ls, old, labels[i].key, saved[i].value, flags, NULL); \
+                else \
+                        error = set_at(ls, old, labels[i].key, saved[i].value, flags, NULL); \
                 if (error) \
                         break; \
         } \
         for (int i = 0; i < n; ++i) { \
-                free((void *)values[i].buf); \
+                free((void *)saved[i].value.buf); \
         } \
-        free(values); \
+        free(saved); \
         return error;
 
 // TODO - does it matter that these are not applied atomically? The
 // profiler can see a torn state... (some applied, some not).
+// `custom_labels_run_with_replace` avoids this for the current set.
 int custom_labels_run_with(custom_labels_labelset_t *ls, custom_labels_label_t *labels, int n, void *(*cb)(void *), void *data, void **out) {
-        CUSTOM_LABELS_RUN_WITH_IMPL(custom_labels_set)
+        CUSTOM_LABELS_RUN_WITH_IMPL(custom_labels_set, published(ls))
 }
 
 int custom_labels_careful_run_with(custom_labels_labelset_t *ls, custom_labels_label_t *labels, int n, void *(*cb)(void *), void *data, void **out) {
-        CUSTOM_LABELS_RUN_WITH_IMPL(custom_labels_careful_set)
+        CUSTOM_LABELS_RUN_WITH_IMPL(custom_labels_careful_set, true)
+}
+
+// Fills in `ls`, which must be empty and have room for the labels of
+// `parent` plus `n` more, with the labels of `parent` overridden by
+// `labels`. Nothing is copied: all the strings are borrowed from
+// `parent` and `labels`, which must outlive `ls`.
+static void derive(custom_labels_labelset_t *ls, const custom_labels_labelset_t *parent, const custom_labels_label_t *labels, size_t n) {
+        size_t count = 0;
+        struct batch_keys keys;
+        bool sorted = n >= BATCH_SORT_MIN_LABELS && batch_keys_init(&keys, labels, n);
+        for (size_t i = 0; i < n; ++i) {
+                assert(labels[i].key.buf);
+                if (sorted ? keys.overridden[i] : overridden_later(labels, n, i))
+                        continue;
+                custom_labels_label_t lbl = labels[i];
+                if (!lbl.value.buf)
+                        lbl.value = (custom_labels_string_t) {0, empty_buf};
+                ls->storage[count] = lbl;
+                ls->block->fingerprints[count] = fingerprint(hash_bytes(lbl.key));
+                ls->block->flags[count++] = LABEL_KEY_BORROWED | LABEL_VALUE_BORROWED;
+        }
+        size_t n_new = count;
+        for (size_t i = 0; parent && i < parent->count; ++i) {
+                const custom_labels_label_t *lbl = &parent->storage[i];
+                bool overridden = false;
+                if (sorted) {
+                        overridden = batch_has_key(&keys, labels, n, lbl->key, hash_bytes(lbl->key));
+                } else {
+                        for (size_t j = 0; j < n_new && !overridden; ++j)
+                                overridden = eq(lbl->key, ls->storage[j].key);
+                }
+                if (overridden)
+                        continue;
+                unsigned char key_flags = (parent->block->flags[i] & LABEL_KEY_INTERNED) ? LABEL_KEY_INTERNED : LABEL_KEY_BORROWED;
+                ls->storage[count] = *lbl;
+                ls->block->fingerprints[count] = parent->block->fingerprints[i];
+                ls->block->flags[count++] = key_flags | LABEL_VALUE_BORROWED | (parent->block->flags[i] & LABEL_VALUE_TYPE);
+        }
+        ls->count = count;
+        if (sorted)
+                batch_keys_free(&keys);
+}
+
+// Label scopes (see `custom_labels_scope_push`) are kept on a per-thread
+// stack of memory chunks. A scope is a derived label set whose block comes
+// from the stack, so once a thread's stack has grown big enough for its
+// deepest nesting, pushing and popping scopes never allocates.
+//
+// Chunks are never moved or resized, since the label sets in them may be
+// installed.
+struct scope_chunk {
+        struct scope_chunk *prev;
+        size_t size;
+        size_t used;
+        // The number of scopes in the chunk that haven't been popped.
+        size_t live;
+        // Set if a scope was popped while readers may have been reading
+        // it. Its memory isn't reused then, and the chunk is retired
+        // once all of its scopes are popped.
+        bool read;
+        // followed by `size` bytes of scopes
+};
+
+struct _custom_labels_scope {
+        custom_labels_labelset_t ls;
+        custom_labels_labelset_t *old;
+        custom_labels_scope_t prev;
+        struct scope_chunk *chunk;
+        // followed by the block of `ls`
+};
+
+#define SCOPE_CHUNK_MIN_SIZE 4096
+
+struct scope_stack {
+        struct scope_chunk *chunk;
+        // An empty chunk kept around so that a thread whose scopes
+        // keep crossing a chunk boundary doesn't allocate every time.
+        struct scope_chunk *spare;
+        custom_labels_scope_t top;
+
+        ~scope_stack() {
+                free(spare);
+                while (chunk) {
+                        struct scope_chunk *prev = chunk->prev;
+                        free(chunk);
+                        chunk = prev;
+                }
+        }
+};
+
+static thread_local struct scope_stack scopes;
+
+// Returns `size` bytes from the top of the thread's scope stack, or NULL
+// if allocation fails. `size` must be a multiple of 8.
+static void *scope_alloc(size_t size) {
+        struct scope_chunk *c = scopes.chunk;
+        if (c && c->size - c->used >= size) {
+                void *p = (unsigned char *)(c + 1) + c->used;
+                c->used += size;
+                ++c->live;
+                return p;
+        }
+        if (scopes.spare && scopes.spare->size >= size) {
+                c = scopes.spare;
+                scopes.spare = NULL;
+        } else {
+                size_t chunk_size = MAX(size, SCOPE_CHUNK_MIN_SIZE);
+                if (scopes.chunk)
+                        chunk_size = MAX(chunk_size, 2 * scopes.chunk->size);
+                c = (struct scope_chunk *)malloc(sizeof(struct scope_chunk) + chunk_size);
+                if (!c)
+                        return NULL;
+                STAT_INC(allocations);
+                STAT_ADD(bytes_allocated, sizeof(struct scope_chunk) + chunk_size);
+                c->size = chunk_size;
+        }
+        c->used = size;
+        c->live = 1;
+        c->read = false;
+        c->prev = scopes.chunk;
+        scopes.chunk = c;
+        return c + 1;
+}
+
+// Releases the memory of `scope`, which must be the most recent allocation.
+static void scope_free(custom_labels_scope_t scope) {
+        struct scope_chunk *c = scope->chunk;
+        assert(c == scopes.chunk);
+        --c->live;
+        if (may_be_read())
+                c->read = true;
+        if (c->read) {
+                if (c->live)
+                        return;
+                scopes.chunk = c->prev;
+                retire(c, sizeof(struct scope_chunk) + c->size, free);
+                return;
+        }
+        c->used = (unsigned char *)scope - (unsigned char *)(c + 1);
+        if (c->used || !c->prev)
+                return;
+        scopes.chunk = c->prev;
+        if (scopes.spare && scopes.spare->size >= c->size) {
+                free(c);
+        } else {
+                free(scopes.spare);
+                scopes.spare = c;
+        }
+}
+
+int custom_labels_scope_push(const custom_labels_label_t *labels, size_t n, custom_labels_scope_t *scope_out) {
+        custom_labels_labelset_t *parent = custom_labels_current_set;
+        size_t capacity = (parent ? parent->count : 0) + n;
+        size_t size = (sizeof(struct _custom_labels_scope) + BLOCK_ALLOC_SIZE(capacity, 0) + 7) & ~(size_t)7;
+        custom_labels_scope_t scope = (custom_labels_scope_t)scope_alloc(size);
+        if (!scope)
+                return errno;
+        struct block *b = block_init(scope + 1, capacity, 0, true);
+        scope->ls = (custom_labels_labelset_t) { block_labels(b), 0, capacity, new_generation(), b->flags, b, NULL, NULL, 0, 0, 0 };
+        scope->chunk = scopes.chunk;
+        scope->prev = scopes.top;
+        derive(&scope->ls, parent, labels, n);
+
+        scope->old = custom_labels_replace(&scope->ls);
+        scopes.top = scope;
+        *scope_out = scope;
+        return 0;
+}
+
+void custom_labels_scope_pop(custom_labels_scope_t scope) {
+        // Scopes must be popped in the reverse order they were pushed;
+        // if some were skipped, pop them too.
+        assert(scope == scopes.top);
+        custom_labels_scope_t s;
+        do {
+                s = scopes.top;
+                custom_labels_replace(s->old);
+                scopes.top = s->prev;
+                // The derived set may have been changed
+                // while it was installed, and own things.
+                careful_destroy(&s->ls);
+                scope_free(s);
+        } while (s != scope);
+}
+
+int custom_labels_run_with_replace(const custom_labels_label_t *labels, int n, void *(*cb)(void *), void *data, void **out) {
+        custom_labels_scope_t scope;
+        int error = custom_labels_scope_push(labels, n, &scope);
+        if (error)
+                return error;
+        void *cb_ret = cb(data);
+        if (out) {
+                *out = cb_ret;
+        }
+        custom_labels_scope_pop(scope);
+        return 0;
 }
 
 size_t custom_labels_count(custom_labels_labelset_t *ls) {
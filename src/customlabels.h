@@ -1,12 +1,11 @@
 #ifndef CUSTOMLABELS_H
 #define CUSTOMLABELS_H
+#include <stddef.h>
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
 
-typedef unsigned long size_t;
-typedef unsigned uint32_t;
-
 typedef struct {
         size_t len;
         const unsigned char *buf;
@@ -23,17 +22,117 @@ typedef struct {
 struct _custom_labels_ls;
 typedef struct _custom_labels_ls custom_labels_labelset_t;
 
+struct _custom_labels_scope;
+/**
+ * A handle to a label scope. See `custom_labels_scope_push`.
+ */
+typedef struct _custom_labels_scope *custom_labels_scope_t;
+
+struct _custom_labels_key;
+/**
+ * A handle to an interned label key. See `custom_labels_key_intern`.
+ */
+typedef const struct _custom_labels_key *custom_labels_key_t;
+
 /**
  * <div rustbindgen hide></div>
  */
 extern __thread custom_labels_labelset_t *custom_labels_current_set;
 
+/**
+ * The labels of an interned label set. See `custom_labels_intern_set`.
+ */
+typedef struct {
+        const custom_labels_label_t *labels;
+        size_t count;
+} custom_labels_id_entry_t;
+
+#define CUSTOM_LABELS_ID_CHUNK_SIZE 1024
+#define CUSTOM_LABELS_ID_MAX_CHUNKS 4096
+
+/**
+ * The table of interned label sets, which profilers may read. The labels
+ * for ID `id` are at `chunks[(id - 1) / CUSTOM_LABELS_ID_CHUNK_SIZE]
+ * [(id - 1) % CUSTOM_LABELS_ID_CHUNK_SIZE]`, for `id <= count`.
+ * Entries are only ever appended, and never change once they are.
+ */
+typedef struct {
+        uint64_t count;
+        custom_labels_id_entry_t *chunks[CUSTOM_LABELS_ID_MAX_CHUNKS];
+} custom_labels_id_table_t;
+
+/**
+ * <div rustbindgen hide></div>
+ */
+extern custom_labels_id_table_t custom_labels_id_table;
+
+/**
+ * The ID of the current label set on this thread, or 0 if it
+ * has none. See `custom_labels_intern_set`.
+ *
+ * <div rustbindgen hide></div>
+ */
+extern __thread uint64_t custom_labels_current_id;
+
 
 /**
  * Get a pointer to the current label set on this thread.
  */
 custom_labels_labelset_t *custom_labels_current();
 
+/**
+ * Intern the labels of the given set, giving it an ID that identifies
+ * them: any two sets with the same labels (in any order) get the same ID
+ * for as long as the process lives. The labels are copied into
+ * `custom_labels_id_table`, where profilers can find them by ID.
+ *
+ * While a set that has an ID is the current set, its ID is published in
+ * `custom_labels_current_id`, so that profilers can record it rather than
+ * reading the labels on every sample. Changing the set takes its ID away,
+ * until it is interned again; clones keep the ID of the original.
+ *
+ * Interning takes a global lock and is meant for sets that are installed
+ * many times, not for every set. Interned labels are never freed.
+ *
+ * Optionally, if `id_out` is non-NULL, write the ID into it.
+ *
+ * Returns 0 on success, `errno` otherwise (ENOSPC if the table is full).
+ */
+int custom_labels_intern_set(custom_labels_labelset_t *ls, uint64_t *id_out);
+
+/**
+ * Get the ID of the given label set, or 0 if it has none.
+ * See `custom_labels_intern_set`.
+ */
+uint64_t custom_labels_set_id(const custom_labels_labelset_t *ls);
+
+#define CUSTOM_LABELS_SNAPSHOT_VERSION 1
+#define CUSTOM_LABELS_SNAPSHOT_TRUNCATED 0x1
+
+/**
+ * Copy the labels of the current set on this thread into `buf`, which
+ * is `cap` bytes long, as seen by a profiler: labels with null keys are
+ * skipped, and only the first label for any key is kept.
+ *
+ * This is async-signal-safe and does not allocate, so it may be called
+ * from a signal handler that interrupted this library on the same thread.
+ *
+ * The snapshot is encoded as follows, with all integers little-endian:
+ *
+ *   u8 version (CUSTOM_LABELS_SNAPSHOT_VERSION)
+ *   u8 flags
+ *   u32 count
+ *   count times: u32 key_len, key bytes, u32 value_len, value bytes
+ *
+ * If not all the labels fit, as many as do are written and the
+ * CUSTOM_LABELS_SNAPSHOT_TRUNCATED flag is set.
+ *
+ * Returns the number of bytes written, or 0 if `cap` is too small for
+ * even an empty snapshot (6 bytes). Snapshots can be turned back into
+ * label sets with `custom_labels_decode`.
+ */
+size_t custom_labels_snapshot_current(void *buf, size_t cap);
+
 /**
  * Get the label corresponding to a key on the given label set, or NULL if none exists.
  *
@@ -59,6 +158,14 @@ const custom_labels_label_t *custom_labels_get(custom_labels_labelset_t *ls, cus
  */
 void custom_labels_delete(custom_labels_labelset_t *ls, custom_labels_string_t key);
 
+/**
+ * Delete the labels with each of the `n` given keys, if they exist,
+ * on the given label set, shrinking it only once.
+ *
+ * It is always safe to call on the current set.
+ */
+void custom_labels_delete_many(custom_labels_labelset_t *ls, const custom_labels_string_t *keys, size_t n);
+
 /**
  * Writes a debug string representing the given label set into `out`.
  * If successful, the caller must free `out->buf`.
@@ -86,20 +193,95 @@ int custom_labels_debug_string(const custom_labels_labelset_t *ls, custom_labels
  *
  * Returns 0 on success, `errno` otherwise.
  */
-// TODO -- to avoid unnecessary copies, there should probably be
-// a few more versions of this function,
-// that take ownership of key and/or value instead of copying them in,
-// or that neither take ownership nor copy them in, and
-// don't delete them when resetting them, where the client
-// takes care that they are valid for as long as they're in the map.
-//
-// Actually, maybe the latter thing is only useful in run_with, and we could just
-// open-code that logic there. But I think the first part
-// (taking by either ownership or copying in) will be more generally important.
-//
-// This would be a lot easier in Rust FWIW.
 int custom_labels_set(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out);
 
+/**
+ * Flags for `custom_labels_set_ex`, saying how it should treat the key
+ * and value it is passed. By default, each is copied in, like
+ * `custom_labels_set` does.
+ *
+ * `_OWNED`: The label set takes ownership of the string's `buf`,
+ * which must have been allocated with `malloc`, and frees it when
+ * the label is deleted or reset or the set is freed. If a label with
+ * the same key already exists, it keeps its key and the passed one
+ * is freed right away. If `custom_labels_set_ex` fails, ownership
+ * stays with the caller.
+ *
+ * `_BORROWED`: The label set points at the string's `buf` without
+ * copying or ever freeing it. The caller must make sure it stays valid
+ * and unchanged for as long as the label set refers to it.
+ *
+ * Clones of a label set always copy in strings that were owned
+ * or borrowed by the original.
+ */
+#define CUSTOM_LABELS_KEY_OWNED 0x1
+#define CUSTOM_LABELS_KEY_BORROWED 0x2
+#define CUSTOM_LABELS_VALUE_OWNED 0x4
+#define CUSTOM_LABELS_VALUE_BORROWED 0x8
+
+/**
+ * Like `custom_labels_set`, but with control over whether the key and
+ * value are copied in, handed over, or borrowed, as described for the
+ * `CUSTOM_LABELS_*_OWNED` and `CUSTOM_LABELS_*_BORROWED` flags.
+ *
+ * This function forwards to `custom_labels_careful_set_ex` if `ls`
+ * is the current set.
+ */
+int custom_labels_set_ex(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, unsigned flags, custom_labels_string_t *old_value_out);
+
+/**
+ * Encode the labels of `ls` (which may be NULL, for no labels) into
+ * `buf`, which is `cap` bytes long, in the format of
+ * `custom_labels_snapshot_current`, e.g. to pass them to another
+ * process. This does not allocate.
+ *
+ * Typed values are encoded as decimal text, as in snapshots.
+ *
+ * Returns the size of the whole encoding. If that is more than `cap`,
+ * `buf` holds as much as fits (with the CUSTOM_LABELS_SNAPSHOT_TRUNCATED
+ * flag set, if `cap` is at least 6), and the caller may try again with
+ * a buffer of the returned size.
+ */
+size_t custom_labels_encode_into(const custom_labels_labelset_t *ls, void *buf, size_t cap);
+
+/**
+ * Add the labels encoded in the `len` bytes at `buf` (by
+ * `custom_labels_encode_into` or `custom_labels_snapshot_current`)
+ * to `ls`, replacing any existing labels with the same keys.
+ *
+ * `flags` are `custom_labels_set_ex` flags for each of the labels; only
+ * the `_BORROWED` ones are allowed. With both, nothing is copied and
+ * the labels point into `buf`, which must then outlive `ls` and stay
+ * unchanged.
+ *
+ * Returns 0 on success, `EINVAL` if `buf` is not a valid encoding (in
+ * which case `ls` is unchanged), or `errno` otherwise.
+ */
+int custom_labels_decode_into(custom_labels_labelset_t *ls, const void *buf, size_t len, unsigned flags);
+
+/**
+ * Like `custom_labels_decode_into`, but into a new label set, which
+ * is written to `*out`.
+ */
+int custom_labels_decode(const void *buf, size_t len, unsigned flags, custom_labels_labelset_t **out);
+
+/**
+ * Set `n` labels on the given label set, with the same result as
+ * calling `custom_labels_set` on each of them in order (so if a key
+ * appears more than once, its last value wins).
+ *
+ * The set is grown at most once, and profilers see either none or all
+ * of the new labels, which makes this cheaper than setting the labels
+ * one at a time. It is always safe to call on the current set.
+ *
+ * SAFETY:
+ * The caller must not pass a NULL value for any key.buf
+ *
+ * Returns 0 on success, `errno` otherwise, in which case
+ * the set is unchanged.
+ */
+int custom_labels_set_many(custom_labels_labelset_t *ls, const custom_labels_label_t *labels, size_t n);
+
 /**
  * Create a new label set.
  *
@@ -108,12 +290,171 @@ int custom_labels_set(custom_labels_labelset_t *ls, custom_labels_string_t key,
 custom_labels_labelset_t *custom_labels_new(size_t capacity);
 
 /**
- * Frees all memory associated with a label set.
+ * Frees all memory associated with a label set, or, if it is frozen,
+ * drops a reference to it (see `custom_labels_freeze`).
  *
- * SAFETY: The label set must not be currently installed.
+ * SAFETY: The label set must not be currently installed
+ * (unless it is frozen and this is not the last reference).
  */
 void custom_labels_free(custom_labels_labelset_t *ls);
 
+/**
+ * Statistics about the calling thread's label set pool.
+ * See `custom_labels_pool_configure`.
+ */
+typedef struct {
+        /** Sets handed out from the pool. */
+        size_t hits;
+        /** Sets that had to be allocated because the pool had none that fit. */
+        size_t misses;
+        /** Freed sets that were put in the pool. */
+        size_t recycled;
+        /** Freed sets that were too big to be put in the pool. */
+        size_t discarded;
+        /** Sets currently in the pool. */
+        size_t sets;
+        /** Bytes currently held by the pool. */
+        size_t bytes;
+} custom_labels_pool_stats_t;
+
+/**
+ * Enable, reconfigure or (with zero limits) disable label set pooling.
+ *
+ * When pooling is enabled, each thread keeps up to `max_sets` label sets
+ * freed on it, holding at most `max_bytes` bytes in total, together with
+ * the memory for their labels. `custom_labels_new` and the clone functions
+ * reuse them rather than allocating, when they are big enough.
+ *
+ * Pooling is disabled by default. The limits apply to all threads.
+ */
+void custom_labels_pool_configure(size_t max_sets, size_t max_bytes);
+
+/**
+ * Get statistics about the calling thread's label set pool.
+ */
+void custom_labels_pool_stats(custom_labels_pool_stats_t *out);
+
+/**
+ * Start reading label sets of other threads from within the process
+ * (e.g., from a sampler thread), returning a token to pass to
+ * `custom_labels_read_end` when done.
+ *
+ * Until then, memory that a set could have pointed to when the read
+ * started is not freed: the careful functions and `custom_labels_free`
+ * hand it to the thread that released it to be freed later (see
+ * `custom_labels_reclaim`). The functions that forward to the careful
+ * ones for the current set also do so for a set that was replaced as
+ * the current set while a read was going on, until that read is over.
+ *
+ * Sets may change while they are read, so readers must read them like
+ * a seqlock to get a consistent view, as described under "Caching by
+ * generation" in custom-labels-v2.md.
+ *
+ * Reads should be short, since memory piles up while any are going on.
+ * This is async-signal-safe.
+ */
+uint64_t custom_labels_read_begin(void);
+
+/**
+ * Finish a read started with `custom_labels_read_begin`.
+ */
+void custom_labels_read_end(uint64_t token);
+
+/**
+ * Set how many bytes of released memory each thread holds on to before
+ * freeing it, or (with 0, the default) free it as soon as no reader
+ * started with `custom_labels_read_begin` could be using it.
+ *
+ * Readers outside the process (e.g., agents using `process_vm_readv`)
+ * can't announce themselves; holding on to memory makes it unlikely,
+ * though not impossible, for them to read it after it's freed. Memory
+ * is freed in batches, oldest first, whenever a thread holds more than
+ * `max_bytes`. For the same reason, sets that have been current are
+ * changed carefully from then on. The limit applies to all threads.
+ */
+void custom_labels_reclaim_configure(size_t max_bytes);
+
+/**
+ * Free whatever memory the calling thread holds on to that no reader
+ * can still be using, e.g. when the thread is about to go idle.
+ * Anything left is freed when the thread exits.
+ */
+void custom_labels_reclaim(void);
+
+/**
+ * Counters of what the library has done, since the process started.
+ * See `custom_labels_stats`.
+ */
+typedef struct {
+        /** Labels set, by any of the set functions. */
+        uint64_t labels_set;
+        /** Labels deleted. */
+        uint64_t labels_deleted;
+        /** Calls to `custom_labels_replace`, including those made by scopes. */
+        uint64_t replaces;
+        /** Sets and deletes made carefully, because they were on the current set. */
+        uint64_t careful_ops;
+        /** Times a label set was moved to new storage to make room for more labels. */
+        uint64_t reallocations;
+        /** Allocations made for label sets, their labels and their indexes. */
+        uint64_t allocations;
+        /** Bytes in those allocations. */
+        uint64_t bytes_allocated;
+        /**
+         * Label sets made by `custom_labels_new` and the clone functions.
+         * Subtract `labelsets_freed` to get the number that are live.
+         */
+        uint64_t labelsets_created;
+        /** Label sets freed (for frozen sets, when the last reference was dropped). */
+        uint64_t labelsets_freed;
+        /** Distinct keys interned by `custom_labels_key_intern`. */
+        uint64_t keys_interned;
+        /** Distinct label sets interned by `custom_labels_intern_set`. */
+        uint64_t sets_interned;
+} custom_labels_stats_t;
+
+/**
+ * The counters of one thread. See `custom_labels_stats_table`.
+ */
+typedef struct _custom_labels_thread_stats {
+        custom_labels_stats_t counters;
+        /** Nonzero while a thread is counting into this record. */
+        uint64_t in_use;
+        struct _custom_labels_thread_stats *next;
+} custom_labels_thread_stats_t;
+
+#define CUSTOM_LABELS_STATS_VERSION 1
+
+/**
+ * Where the counters summed by `custom_labels_stats` live, for agents that
+ * read them from outside the process. Each thread counts into a record of
+ * its own, and the totals are `shared` plus the `counters` of every record
+ * in the `threads` list. Records are never freed or unlinked: when a thread
+ * exits, its counts are added to `shared` and the record is reused by a
+ * later thread. A total read while a thread exits may be off by that
+ * thread's counts.
+ *
+ * `version` is `CUSTOM_LABELS_STATS_VERSION`; fields are only ever added
+ * to the end of `custom_labels_stats_t`, along with a new version.
+ */
+typedef struct {
+        uint64_t version;
+        custom_labels_stats_t shared;
+        custom_labels_thread_stats_t *threads;
+} custom_labels_stats_table_t;
+
+/**
+ * <div rustbindgen hide></div>
+ */
+extern custom_labels_stats_table_t custom_labels_stats_table;
+
+/**
+ * Get the library's counters, summed over all threads, past and present.
+ * Each thread counts on its own, without synchronization, so the sum is
+ * only approximately a snapshot.
+ */
+void custom_labels_stats(custom_labels_stats_t *out);
+
 /**
  * Install the given label set as the current one, returning the old one.
  */
@@ -122,6 +463,12 @@ custom_labels_labelset_t *custom_labels_replace(custom_labels_labelset_t *ls);
 /**
  * Clone the given label set.
  *
+ * The clone shares the bytes of the original's keys and values rather
+ * than copying them, so cloning costs roughly one allocation plus a copy
+ * of the label array; labels set on either set afterwards are not shared.
+ * Shared bytes stay alive for as long as any set refers to them, and the
+ * original and its clones may be used and freed on different threads.
+ *
  * Returns the clone on success, NULL otherwise.
  */
 custom_labels_labelset_t *custom_labels_clone(const custom_labels_labelset_t *ls);
@@ -133,6 +480,36 @@ custom_labels_labelset_t *custom_labels_clone(const custom_labels_labelset_t *ls
  */
 custom_labels_labelset_t *custom_labels_clone_with_capacity(const custom_labels_labelset_t *ls, size_t capacity);
 
+/**
+ * Make the given label set read-only, so that it can be shared between
+ * threads and installed as the current set on any number of them at once.
+ *
+ * A frozen set is reference-counted: the caller holds the first reference,
+ * `custom_labels_retain` takes another, and `custom_labels_free` drops
+ * one, freeing the set when the last is dropped. A set must not be freed
+ * while it is current on some thread, so each thread that installs it
+ * should hold a reference until it has replaced it again.
+ *
+ * Functions that would change a frozen set fail with `EPERM` (or, for
+ * those that can't fail, do nothing). Its clones are not frozen.
+ * Interning it (see `custom_labels_intern_set`) returns its ID without
+ * associating it with the set, so sets should be interned before they
+ * are frozen for profilers to see their IDs.
+ *
+ * Freezing a frozen set does nothing.
+ */
+void custom_labels_freeze(custom_labels_labelset_t *ls);
+
+/**
+ * Take another reference to the given frozen label set, returning it.
+ */
+custom_labels_labelset_t *custom_labels_retain(custom_labels_labelset_t *ls);
+
+/**
+ * Whether the given label set is frozen (see `custom_labels_freeze`).
+ */
+int custom_labels_is_frozen(const custom_labels_labelset_t *ls);
+
 /**
  * Run the supplied callback function (passing it the supplied data pointer)
  * with the supplied set of N labels applied,
@@ -141,10 +518,148 @@ custom_labels_labelset_t *custom_labels_clone_with_capacity(const custom_labels_
  */
 int custom_labels_run_with(custom_labels_labelset_t *ls, custom_labels_label_t *labels, int n, void *(*cb)(void *), void *data, void **out);
 
+/**
+ * Run the supplied callback function (passing it the supplied data pointer)
+ * with the supplied set of N labels applied on top of the current set,
+ * then restore the old set. Optionally, if out is non-NULL,
+ * write the return value of the callback into out.
+ *
+ * Unlike `custom_labels_run_with`, this does not modify the current set.
+ * Instead, it builds a derived set that borrows the strings of the current
+ * set and of `labels`, and installs it with a single `custom_labels_replace`,
+ * so a profiler sees either all of the labels applied or none of them.
+ * This is equivalent to wrapping the callback in `custom_labels_scope_push`
+ * and `custom_labels_scope_pop`.
+ *
+ * Any changes the callback makes to the current set apply to the derived
+ * set, and are therefore discarded when it returns. The callback must not
+ * modify or free the old current set, whose strings are borrowed.
+ *
+ * Returns 0 on success, `errno` otherwise.
+ */
+int custom_labels_run_with_replace(const custom_labels_label_t *labels, int n, void *(*cb)(void *), void *data, void **out);
+
+/**
+ * Enter a label scope on the current thread: install a label set consisting
+ * of the current set's labels overridden by the supplied N labels, and
+ * write a handle to the scope into `scope_out`.
+ *
+ * Like `custom_labels_run_with_replace`, the new set is installed atomically
+ * and borrows all of its strings, which must remain valid and unchanged until
+ * the scope is popped. The label sets of a thread's scopes are kept on a
+ * per-thread stack, so entering and leaving scopes does no allocation once
+ * that stack has grown to fit the deepest nesting.
+ *
+ * Readers on other threads (see `custom_labels_read_begin`) may still be
+ * reading a scope's set after it is popped. While there are any, the
+ * memory of popped scopes is retired rather than reused, so entering
+ * scopes may allocate, and the strings must stay valid until the reads
+ * are done as well.
+ *
+ * Returns 0 on success, `errno` otherwise.
+ */
+int custom_labels_scope_push(const custom_labels_label_t *labels, size_t n, custom_labels_scope_t *scope_out);
+
+/**
+ * Leave a label scope, re-installing the label set that was current when
+ * it was entered. Any changes made to the current set while the scope was
+ * active are discarded.
+ *
+ * Scopes must be popped on the thread that pushed them, in the reverse
+ * order they were pushed.
+ */
+void custom_labels_scope_pop(custom_labels_scope_t scope);
+
 /**
  * Get the number of labels in the label set.
  */
 size_t custom_labels_count(custom_labels_labelset_t *ls);
+
+/**
+ * Intern a label key, returning a handle that can be passed to the `_k`
+ * variants of `custom_labels_get`, `custom_labels_set` and `custom_labels_delete`.
+ *
+ * Interning the same bytes twice returns the same handle. Handles, and
+ * the single copy of the key bytes they refer to, remain valid for
+ * the lifetime of the process, so this should only be used for keys
+ * drawn from a small, fixed vocabulary.
+ *
+ * This function is thread-safe.
+ *
+ * Returns NULL if allocation fails.
+ */
+custom_labels_key_t custom_labels_key_intern(custom_labels_string_t key);
+
+/**
+ * Get the bytes of an interned key.
+ */
+custom_labels_string_t custom_labels_key_string(custom_labels_key_t key);
+
+/**
+ * Like `custom_labels_get`, but looks up the label by interned key.
+ *
+ * Labels that were set with the `_k` functions are found by comparing
+ * pointers only; those set by string fall back to comparing bytes.
+ */
+const custom_labels_label_t *custom_labels_get_k(custom_labels_labelset_t *ls, custom_labels_key_t key);
+
+/**
+ * Like `custom_labels_set`, but with an interned key.
+ *
+ * The label set refers to the interned copy of the key rather
+ * than copying it in.
+ */
+int custom_labels_set_k(custom_labels_labelset_t *ls, custom_labels_key_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out);
+
+/**
+ * Like `custom_labels_delete`, but with an interned key.
+ */
+void custom_labels_delete_k(custom_labels_labelset_t *ls, custom_labels_key_t key);
+
+/**
+ * The types of label values. Typed values are stored as their 8
+ * little-endian bytes, which is what `custom_labels_get` returns, and
+ * profilers that support it decode them (see "Optional: typed values" in
+ * custom-labels-v2.md). Everywhere else that the library turns labels
+ * into text (debug strings, snapshots and interned sets), they are
+ * written in decimal.
+ */
+#define CUSTOM_LABELS_VALUE_BYTES 0
+#define CUSTOM_LABELS_VALUE_U64 1
+#define CUSTOM_LABELS_VALUE_I64 2
+
+/**
+ * Set a label with an unsigned or signed 64-bit integer value, which is
+ * stored without being formatted. Otherwise like `custom_labels_set`.
+ *
+ * Returns 0 on success, `errno` otherwise.
+ */
+int custom_labels_set_u64(custom_labels_labelset_t *ls, custom_labels_string_t key, uint64_t value);
+int custom_labels_set_i64(custom_labels_labelset_t *ls, custom_labels_string_t key, int64_t value);
+
+/**
+ * Like `custom_labels_set_u64` and `custom_labels_set_i64`, but with
+ * an interned key.
+ */
+int custom_labels_set_u64_k(custom_labels_labelset_t *ls, custom_labels_key_t key, uint64_t value);
+int custom_labels_set_i64_k(custom_labels_labelset_t *ls, custom_labels_key_t key, int64_t value);
+
+/**
+ * The `CUSTOM_LABELS_VALUE_*` type of the value of `lbl`, which
+ * must be a label of `ls` (e.g., as returned by `custom_labels_get`).
+ */
+unsigned custom_labels_value_type(const custom_labels_labelset_t *ls, const custom_labels_label_t *lbl);
+
+/**
+ * Get the value of a label set with `custom_labels_set_u64` or
+ * `custom_labels_set_i64` respectively.
+ *
+ * Returns 0 on success, `ENOENT` if there is no such label, or `EINVAL`
+ * if its value has a different type.
+ */
+int custom_labels_get_u64(custom_labels_labelset_t *ls, custom_labels_string_t key, uint64_t *out);
+int custom_labels_get_i64(custom_labels_labelset_t *ls, custom_labels_string_t key, int64_t *out);
+
 // "careful" functions:
 // These all do the same thing as the non-careful versions.
 //
@@ -156,6 +671,12 @@ void custom_labels_careful_delete(custom_labels_labelset_t *ls, custom_labels_st
 
 int custom_labels_careful_set(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out);
 
+void custom_labels_careful_delete_k(custom_labels_labelset_t *ls, custom_labels_key_t key);
+
+int custom_labels_careful_set_k(custom_labels_labelset_t *ls, custom_labels_key_t key, custom_labels_string_t value, custom_labels_string_t *old_value_out);
+
+int custom_labels_careful_set_ex(custom_labels_labelset_t *ls, custom_labels_string_t key, custom_labels_string_t value, unsigned flags, custom_labels_string_t *old_value_out);
+
 int custom_labels_careful_run_with(custom_labels_labelset_t *ls, custom_labels_label_t *labels, int n, void *(*cb)(void *), void *data, void **out);
 
 #ifdef __cplusplus
@@ -0,0 +1,76 @@
+#ifndef CUSTOMLABELS_INLINE_H
+#define CUSTOMLABELS_INLINE_H
+#include "customlabels.h"
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/*
+ * Inline versions of the cheapest functions in customlabels.h, which
+ * compile down to a few loads and stores in the caller, for programs
+ * that link the library into the main executable (e.g., as
+ * libcustomlabels.a; see the README). Code compiled for an executable
+ * reaches `custom_labels_current_set` at a fixed offset from the
+ * thread pointer; code compiled with -fPIC should also be compiled
+ * with -ftls-model=initial-exec to get the same.
+ *
+ * This header must come from the same version of the library as the
+ * code it is linked with, since it depends on the layout of label sets.
+ */
+
+/**
+ * The leading fields of `custom_labels_labelset_t`; customlabels.cpp
+ * checks that they match.
+ *
+ * <div rustbindgen hide></div>
+ */
+struct _custom_labels_ls_prefix {
+        custom_labels_label_t *storage;
+        size_t count;
+        size_t capacity;
+        uint64_t generation;
+        const unsigned char *tags;
+        void *block;
+        void *pool_next;
+        void *index;
+        uint64_t id;
+        size_t refs;
+        uint64_t unpublished;
+};
+
+/**
+ * Like `custom_labels_replace`, but not counted in `custom_labels_stats`
+ * and without the `replace` tracepoint.
+ */
+static inline custom_labels_labelset_t *custom_labels_inline_replace(custom_labels_labelset_t *ls) {
+        custom_labels_labelset_t *old = custom_labels_current_set;
+        // See `custom_labels_replace` for why each step must be
+        // finished before the next.
+        __atomic_store_n(&custom_labels_current_id, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&custom_labels_current_set, ls, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&custom_labels_current_id, ls ? ((const struct _custom_labels_ls_prefix *)ls)->id : 0, __ATOMIC_RELEASE);
+        // Mark the old set as `custom_labels_replace` does.
+        if (old && !__atomic_load_n(&((struct _custom_labels_ls_prefix *)old)->refs, __ATOMIC_RELAXED))
+                ((struct _custom_labels_ls_prefix *)old)->unpublished = UINT64_MAX;
+        return old;
+}
+
+/**
+ * Like `custom_labels_current`.
+ */
+static inline custom_labels_labelset_t *custom_labels_inline_current(void) {
+        return custom_labels_current_set;
+}
+
+/**
+ * Like `custom_labels_count`.
+ */
+static inline size_t custom_labels_inline_count(const custom_labels_labelset_t *ls) {
+        return ((const struct _custom_labels_ls_prefix *)ls)->count;
+}
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+#endif // CUSTOMLABELS_INLINE_H
@@ -12,6 +12,24 @@
 // Then if the profiler is invoked between those two points,
 // it will see the new value of `count` and possibly
 // try to read gibberish.
+//
+// Readers on other threads that aren't stopped (see
+// `custom_labels_read_begin`) also need the CPU to keep the stores in
+// order, so where they matter to readers, stores that make something
+// visible are releases (`__atomic_store_n(..., __ATOMIC_RELEASE)`),
+// and those that hide something are followed by a release fence.
 #define BARRIER asm volatile("": : :"memory")
 
+// Static tracepoints (USDT) in the `custom_labels` provider, for
+// tracing label changes with bpftrace, perf and the like. They are
+// only compiled in when CUSTOM_LABELS_USDT is defined (`make USDT=1`,
+// or the `usdt` feature of the Rust crate), and each is a single nop
+// until a tracer attaches to it.
+#ifdef CUSTOM_LABELS_USDT
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(custom_labels, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
 #endif